@@ -0,0 +1,174 @@
+#ifndef HR_BENCH_H
+#define HR_BENCH_H
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+
+// Header-only microbenchmark harness. A benchmark is a setup, run untimed before every repetition,
+// and a body timed over a number of iterations picked during the warmup so that a repetition lasts
+// at least min_time. Results are per item, a body handling items items per call, and summarized by
+// their median and median absolute deviation, which a few preempted repetitions do not move.
+// A summary line per benchmark goes to stderr and one CSV row or JSON object to stdout.
+//
+// Options: --filter=<substring of the name> --warmup=N --repetitions=N --min-time=<seconds>
+//          --format=csv|json
+const int HR_BENCH_MAX_ITERATIONS = 1 << 24;
+
+struct HR_BenchOptions {
+    std::string filter;
+    int warmup;
+    int repetitions;
+    double min_time;
+    bool json;
+};
+
+struct HR_BenchStats {
+    double median;                          // nanoseconds per item, like the rest
+    double mad;
+    double mean;
+    double stddev;
+    double min;
+    double max;
+};
+
+inline HR_BenchOptions bench_options(int argc, char** argv) {
+    HR_BenchOptions options;
+    options.warmup = 3;
+    options.repetitions = 15;
+    options.min_time = 0.02;
+    options.json = false;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg.find("--filter=") == 0) {
+            options.filter = arg.substr(strlen("--filter="));
+        } else if (arg.find("--warmup=") == 0) {
+            options.warmup = std::max(atoi(arg.c_str() + strlen("--warmup=")), 1);
+        } else if (arg.find("--repetitions=") == 0) {
+            options.repetitions = std::max(atoi(arg.c_str() + strlen("--repetitions=")), 1);
+        } else if (arg.find("--min-time=") == 0) {
+            options.min_time = atof(arg.c_str() + strlen("--min-time="));
+        } else if (arg.find("--format=") == 0) {
+            options.json = arg.substr(strlen("--format=")) == "json";
+        } else {
+            fprintf(stderr, "Unknown option: %s\n", arg.c_str());
+            exit(1);
+        }
+    }
+    return options;
+}
+
+// Keeps the compiler from dropping a computation whose result is otherwise unused
+template <typename T>
+inline void bench_do_not_optimize(const T& value) {
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+inline double bench_median(std::vector<double> values) {
+    std::sort(values.begin(), values.end());
+    size_t middle = values.size() / 2;
+    return values.size() % 2 ? values[middle] : (values[middle - 1] + values[middle]) / 2;
+}
+
+inline HR_BenchStats bench_stats(const std::vector<double>& samples) {
+    HR_BenchStats stats;
+    stats.median = bench_median(samples);
+    std::vector<double> deviations;
+    double sum = 0;
+    for (double sample : samples) {
+        deviations.push_back(fabs(sample - stats.median));
+        sum += sample;
+    }
+    stats.mad = bench_median(deviations);
+    stats.mean = sum / samples.size();
+    double squares = 0;
+    for (double sample : samples) {
+        squares += (sample - stats.mean) * (sample - stats.mean);
+    }
+    stats.stddev = samples.size() > 1 ? sqrt(squares / (samples.size() - 1)) : 0;
+    stats.min = *std::min_element(samples.begin(), samples.end());
+    stats.max = *std::max_element(samples.begin(), samples.end());
+    return stats;
+}
+
+inline void bench_report(
+    const HR_BenchOptions& options,
+    const std::string& name,
+    const std::string& params,
+    long long items,
+    int iterations,
+    const HR_BenchStats& stats
+) {
+    static bool header_written = false;
+    if (options.json) {
+        printf(
+            "{\"name\": \"%s\", \"params\": \"%s\", \"items\": %lld, \"iterations\": %d, \"repetitions\": %d, "
+            "\"median_ns\": %.3f, \"mad_ns\": %.3f, \"mean_ns\": %.3f, \"stddev_ns\": %.3f, \"min_ns\": %.3f, \"max_ns\": %.3f}\n",
+            name.c_str(), params.c_str(), items, iterations, options.repetitions,
+            stats.median, stats.mad, stats.mean, stats.stddev, stats.min, stats.max
+        );
+    } else {
+        if (!header_written) {
+            printf("name,params,items,iterations,repetitions,median_ns,mad_ns,mean_ns,stddev_ns,min_ns,max_ns\n");
+            header_written = true;
+        }
+        printf(
+            "%s,%s,%lld,%d,%d,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f\n",
+            name.c_str(), params.c_str(), items, iterations, options.repetitions,
+            stats.median, stats.mad, stats.mean, stats.stddev, stats.min, stats.max
+        );
+    }
+    fflush(stdout);
+    fprintf(
+        stderr, "%-20s %-32s %12.2f ns/item +- %.2f (min %.2f, max %.2f)\n",
+        name.c_str(), params.c_str(), stats.median, stats.mad, stats.min, stats.max
+    );
+}
+
+template <typename Setup, typename Body>
+void bench_run(
+    const HR_BenchOptions& options,
+    const std::string& name,
+    const std::string& params,
+    long long items,
+    Setup setup,
+    Body body
+) {
+    if (name.find(options.filter) == std::string::npos) {
+        return;
+    }
+
+    auto time_repetition = [&](int iterations) {
+        setup();
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < iterations; i++) {
+            body();
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        return elapsed.count();
+    };
+
+    // The warmup grows the iterations until a repetition takes min_time
+    int iterations = 1;
+    for (int i = 0; i < options.warmup; i++) {
+        double seconds = time_repetition(iterations);
+        if (seconds < options.min_time && iterations < HR_BENCH_MAX_ITERATIONS) {
+            double wanted = 1.2 * iterations * options.min_time / std::max(seconds, 1e-9);
+            iterations = static_cast<int>(std::min<double>(std::max<double>(wanted, 2.0 * iterations), HR_BENCH_MAX_ITERATIONS));
+            i = std::min(i, options.warmup - 2);
+        }
+    }
+
+    std::vector<double> samples;
+    for (int i = 0; i < options.repetitions; i++) {
+        samples.push_back(1e9 * time_repetition(iterations) / (static_cast<double>(iterations) * items));
+    }
+    bench_report(options, name, params, items, iterations, bench_stats(samples));
+}
+
+#endif // HR_BENCH_H
@@ -0,0 +1,262 @@
+#include "bench.h"
+#include "cache.h"
+#include "requests.h"
+#include "metadata.h"
+#include "model.h"
+#include "utils.h"
+#include <numeric>
+#include <random>
+
+// Microbenchmarks of the per-request and per-window hot paths on synthetic data, e.g.
+//   make bench BENCH_ARGS="--filter=calculate_hazard --format=json"
+// Object popularity is skewed so that a few objects get most of the requests, as in the traces.
+const int SEED = 42;
+const int REQUESTS_BATCH = 4096;            // requests per body of the request benchmarks
+const int HAZARD_INPUTS = 1024;
+const int FITTED_OBJECTS = 64;
+const double MEAN_INTERVAL = 600;           // seconds between two requests of an object
+const int MAX_OBJECT_SIZE = 64 * 1024;
+const int BOOST_ROUNDS = 100;
+const std::unordered_map<HR_FEATURE, bool> FEATURES = {
+    {FEAT_FREQUENCY, false},
+    {FEAT_SIZE, true},
+    {FEAT_DECAYED_FREQUENCY, true}
+};
+const double DECAY_FACTOR = 0.9;
+
+static std::mt19937 generator(SEED);
+
+static int skewed_object(int objects_count) {
+    double uniform = std::uniform_real_distribution<double>(0, 1)(generator);
+    return static_cast<int>(objects_count * uniform * uniform * uniform);
+}
+
+static int object_size(int object_id) {
+    return 1 + (object_id * 2654435761u) % MAX_OBJECT_SIZE;
+}
+
+// Exponential intervals in request order, unsorted as calculate_diffs leaves them
+static std::vector<double> random_intervals(int count) {
+    std::exponential_distribution<double> interval(1 / MEAN_INTERVAL);
+    std::vector<double> intervals(count);
+    for (double& value : intervals) {
+        value = interval(generator);
+    }
+    return intervals;
+}
+
+// Labels follow the last feature, with noise, so that the model has something to learn
+static void random_rows(int rows_count, int features_length, std::vector<HR_FeatureValue>* features, std::vector<int>* labels) {
+    std::uniform_real_distribution<double> value(0, 1);
+    std::normal_distribution<double> noise(0, MEAN_INTERVAL / 4);
+    features->resize(static_cast<long long>(rows_count) * features_length);
+    labels->resize(rows_count);
+    for (int row = 0; row < rows_count; row++) {
+        HR_FeatureValue* row_features = features->data() + static_cast<long long>(row) * features_length;
+        for (int feature = 0; feature < features_length; feature++) {
+            row_features[feature] = encode_feature(MEAN_INTERVAL * value(generator));
+        }
+        (*labels)[row] = decode_feature(row_features[features_length - 1]) + noise(generator) > MEAN_INTERVAL / 2;
+    }
+}
+
+static void bench_lookup_and_admit(const HR_BenchOptions& options) {
+    for (int objects_count : {10 * 1000, 100 * 1000}) {
+        // the cache holds about a tenth of the objects
+        long long capacity = static_cast<long long>(objects_count) * MAX_OBJECT_SIZE / 20;
+        std::vector<HR_Request> requests(REQUESTS_BATCH);
+        for (HR_Request& request : requests) {
+            request.object_id = skewed_object(objects_count);
+            request.size = object_size(request.object_id);
+            request.admit_probability = std::uniform_real_distribution<double>(0, 1)(generator);
+        }
+        HR_Cache* cache = NULL;
+        double timestamp = 0;
+
+        bench_run(options, "lookup_and_admit", "objects=" + std::to_string(objects_count), REQUESTS_BATCH,
+            [&]() {
+                if (cache) {
+                    destroy_lru_cache(cache);
+                }
+                cache = create_lru_cache(capacity, 0.5, 0.0, true);
+            },
+            [&]() {
+                for (HR_Request& request : requests) {
+                    request.timestamp = timestamp++;
+                    bench_do_not_optimize(lookup_and_admit(cache, &request));
+                }
+            }
+        );
+        if (cache) {
+            destroy_lru_cache(cache);
+        }
+    }
+}
+
+static void bench_add_request(const HR_BenchOptions& options) {
+    for (int features_length : {8, 32}) {
+        for (int objects_count : {1000, 10 * 1000}) {
+            std::vector<int> object_ids(REQUESTS_BATCH);
+            for (int& object_id : object_ids) {
+                object_id = skewed_object(objects_count);
+            }
+            HR_ObjectsMetadata* objects_metadata = NULL;
+            HR_RequestWindow* request_window = NULL;
+            double timestamp = 0;
+
+            std::string params = "features_length=" + std::to_string(features_length) + " objects=" + std::to_string(objects_count);
+            bench_run(options, "add_request", params, REQUESTS_BATCH,
+                [&]() {
+                    if (request_window) {
+                        destroy_request_window(request_window);
+                        delete objects_metadata;
+                    }
+                    objects_metadata = new HR_ObjectsMetadata(0, features_length, DECAY_FACTOR);
+                    request_window = create_request_window(NULL, 0, features_length, FEATURES, objects_metadata);
+                },
+                [&]() {
+                    for (int object_id : object_ids) {
+                        bench_do_not_optimize(add_request(request_window, object_id, timestamp++, object_size(object_id)));
+                    }
+                }
+            );
+            if (request_window) {
+                destroy_request_window(request_window);
+                delete objects_metadata;
+            }
+        }
+    }
+}
+
+static void bench_calculate_hazard(const HR_BenchOptions& options) {
+    for (int diffs_count : {4, 16, 64, 256}) {
+        // fitted the way prepare_request_window fits a sampled object
+        std::vector<double> durations(diffs_count + 1);
+        std::vector<double> cumulative_hazards(diffs_count + 1);
+        std::vector<double> intervals = random_intervals(diffs_count);
+        std::copy(intervals.begin(), intervals.end(), durations.begin() + 1);
+        long long offset = 0;
+        int count = diffs_count;
+        double bandwidth;
+        nelson_aalen_fit_segments(durations.data(), cumulative_hazards.data(), &offset, &count, &bandwidth, 1, false);
+
+        std::vector<double> inputs(HAZARD_INPUTS);
+        std::uniform_real_distribution<double> input(0, 2 * *std::max_element(intervals.begin(), intervals.end()));
+        for (double& value : inputs) {
+            value = input(generator);
+        }
+
+        bench_run(options, "calculate_hazard", "diffs=" + std::to_string(diffs_count), HAZARD_INPUTS,
+            []() {},
+            [&]() {
+                for (double value : inputs) {
+                    bench_do_not_optimize(calculate_hazard(value, durations.data(), cumulative_hazards.data(), count, bandwidth));
+                }
+            }
+        );
+    }
+}
+
+// Fits FITTED_OBJECTS objects in one segmented buffer, as prepare_objects fits a thread's chunk.
+// Copying the unsorted intervals back in, which the fit sorts in place, is part of the timing.
+static void bench_nelson_aalen_fit_segments(const HR_BenchOptions& options) {
+    for (int diffs_count : {16, 64, 256}) {
+        // slot 0 of every segment is left for the fit, and segments are padded to 8 doubles
+        long long segment_size = (diffs_count + 1 + 7) / 8 * 8;
+        std::vector<double> objects_intervals;
+        std::vector<long long> offsets(FITTED_OBJECTS);
+        for (int i = 0; i < FITTED_OBJECTS; i++) {
+            std::vector<double> intervals = random_intervals(diffs_count);
+            objects_intervals.insert(objects_intervals.end(), intervals.begin(), intervals.end());
+            offsets[i] = i * segment_size;
+        }
+        std::vector<double> durations(FITTED_OBJECTS * segment_size);
+        std::vector<double> cumulative_hazards(FITTED_OBJECTS * segment_size);
+        std::vector<int> counts(FITTED_OBJECTS);
+        std::vector<double> bandwidths(FITTED_OBJECTS);
+
+        bench_run(options, "nelson_aalen_fit_segments", "diffs=" + std::to_string(diffs_count), FITTED_OBJECTS,
+            []() {},
+            [&]() {
+                for (int i = 0; i < FITTED_OBJECTS; i++) {
+                    const double* intervals = objects_intervals.data() + static_cast<long long>(i) * diffs_count;
+                    std::copy(intervals, intervals + diffs_count, durations.begin() + offsets[i] + 1);
+                    counts[i] = diffs_count;
+                }
+                nelson_aalen_fit_segments(
+                    durations.data(), cumulative_hazards.data(), offsets.data(), counts.data(), bandwidths.data(),
+                    FITTED_OBJECTS, false
+                );
+                bench_do_not_optimize(bandwidths[FITTED_OBJECTS - 1]);
+            }
+        );
+    }
+}
+
+static HR_Model* create_trained_model(int features_length, int rows_count) {
+    std::vector<HR_FeatureValue> features;
+    std::vector<int> labels;
+    random_rows(rows_count, features_length, &features, &labels);
+    std::vector<int> rows(rows_count);
+    std::iota(rows.begin(), rows.end(), 0);
+    HR_Model* model = create_hr_model(0, features_length, BOOST_ROUNDS, 0, 0);
+    update_hr_model(model, features.data(), labels.data(), rows.data(), rows_count, false);
+    return model;
+}
+
+static void bench_predict_requests(const HR_BenchOptions& options) {
+    for (int features_length : {8, 32}) {
+        HR_Model* model = create_trained_model(features_length, 10 * 1000);
+        for (int batch_size : {1, 16, 256, 4096}) {
+            std::vector<HR_FeatureValue> features;
+            std::vector<int> labels;
+            random_rows(batch_size, features_length, &features, &labels);
+            std::vector<double> probabilities(batch_size);
+
+            std::string params = "features_length=" + std::to_string(features_length) + " batch=" + std::to_string(batch_size);
+            bench_run(options, "predict_requests", params, batch_size,
+                []() {},
+                [&]() {
+                    predict_requests(model, features.data(), batch_size, probabilities.data());
+                    bench_do_not_optimize(probabilities[batch_size - 1]);
+                }
+            );
+        }
+        destroy_hr_model(model);
+    }
+}
+
+// A full training from an empty model on every call, the cost of the first window's training.
+// Creating the model is part of the timing; it only allocates the training store.
+static void bench_update_hr_model(const HR_BenchOptions& options) {
+    for (int features_length : {8, 32}) {
+        for (int rows_count : {1000, 10 * 1000}) {
+            std::vector<HR_FeatureValue> features;
+            std::vector<int> labels;
+            random_rows(rows_count, features_length, &features, &labels);
+            std::vector<int> rows(rows_count);
+            std::iota(rows.begin(), rows.end(), 0);
+
+            std::string params = "features_length=" + std::to_string(features_length) + " rows=" + std::to_string(rows_count);
+            bench_run(options, "update_hr_model", params, rows_count,
+                []() {},
+                [&]() {
+                    HR_Model* model = create_hr_model(0, features_length, BOOST_ROUNDS, 0, 0);
+                    update_hr_model(model, features.data(), labels.data(), rows.data(), rows_count, false);
+                    destroy_hr_model(model);
+                }
+            );
+        }
+    }
+}
+
+int main(int argc, char** argv) {
+    HR_BenchOptions options = bench_options(argc, argv);
+    bench_lookup_and_admit(options);
+    bench_add_request(options);
+    bench_calculate_hazard(options);
+    bench_nelson_aalen_fit_segments(options);
+    bench_predict_requests(options);
+    bench_update_hr_model(options);
+    return 0;
+}
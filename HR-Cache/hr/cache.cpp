@@ -1,15 +1,23 @@
 #include "requests.h"
 #include "cache.h"
 #include "model.h"
+#include "metadata.h"
+#include <algorithm>
+#include <limits>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <unordered_map>
 
-HR_Cache* create_lru_cache(long long capacity, double hot_lower_bound, double cold_lower_bound, bool evict_hot_for_cold) {
+// Expiry times are kept to a 1 / EXPIRY_TICKS_PER_TTL of the maximum time to live
+const int EXPIRY_TICKS_PER_TTL = 256;
+
+HR_Cache* create_lru_cache(long long capacity, double hot_lower_bound, double cold_lower_bound, bool evict_hot_for_cold, double max_ttl) {
     HR_Cache* cache = new HR_Cache;
-    cache->hot_cache = NULL;
-    cache->cold_cache = NULL;
+    cache->pool.free_list = HR_NULL_NODE;
+    cache->pool.nodes_count = 0;
+    cache->hot_cache = HR_NULL_NODE;
+    cache->cold_cache = HR_NULL_NODE;
+    cache->lookup_table = create_lookup_table(0);
     cache->capacity = capacity;
     cache->current_size = 0;
     cache->current_hot_size = 0;
@@ -17,105 +25,160 @@ HR_Cache* create_lru_cache(long long capacity, double hot_lower_bound, double co
     cache->hot_lower_bound = hot_lower_bound;
     cache->cold_lower_bound = cold_lower_bound;
     cache->evict_hot_for_cold = evict_hot_for_cold;
+    cache->latest_seen = -std::numeric_limits<double>::infinity();
+    cache->demotion_cursor = HR_NULL_NODE;
+    cache->cold_rescore_cursor = HR_NULL_NODE;
+    cache->hot_rescore_cursor = HR_NULL_NODE;
+    cache->max_ttl = max_ttl;
+    cache->expirations = max_ttl > 0 ? create_timing_wheel(max_ttl / EXPIRY_TICKS_PER_TTL) : NULL;
     return cache;
 }
 
-HR_CacheNode* create_node(int id, int size, double timestamp) {
-    HR_CacheNode* node = (HR_CacheNode*)malloc(sizeof(HR_CacheNode));
+int32_t create_node(HR_Cache* cache, int id, int size, double timestamp) {
+    HR_CacheNodePool* pool = &cache->pool;
+    int32_t index = pool->free_list;
+    if (index != HR_NULL_NODE) {
+        pool->free_list = get_node(cache, index)->next;
+    } else {
+        if ((pool->nodes_count & (HR_CACHE_SLAB_SIZE - 1)) == 0) {
+            pool->slabs.push_back(new HR_CacheNode[HR_CACHE_SLAB_SIZE]);
+        }
+        index = pool->nodes_count++;
+    }
+
+    HR_CacheNode* node = get_node(cache, index);
     node->id = id;
     node->size = size;
     node->last_seen = timestamp;
-    node->prev = NULL;
-    node->next = NULL;
-    return node;
+    node->prev = HR_NULL_NODE;
+    node->next = HR_NULL_NODE;
+    return index;
+}
+
+void free_node(HR_Cache* cache, int32_t index) {
+    HR_CacheNode* node = get_node(cache, index);
+    node->prev = HR_NULL_NODE;
+    node->next = cache->pool.free_list;
+    cache->pool.free_list = index;
 }
 
-HR_CacheNode* move_node_to_end(HR_CacheNode* head, HR_CacheNode* node) {
+int32_t move_node_to_end(HR_Cache* cache, int32_t head, int32_t index) {
     // if node is NULL, return head
-    if (!node) {
+    if (index == HR_NULL_NODE) {
         return head;
     }
 
-    if (!head) {
-        node->next = node;
-        node->prev = node;
-        return node;
+    HR_CacheNode* node = get_node(cache, index);
+    if (head == HR_NULL_NODE) {
+        node->next = index;
+        node->prev = index;
+        return index;
     }
 
+    HR_CacheNode* head_node = get_node(cache, head);
     // node is already at the end
-    if (head->prev->id == node->id) {
+    if (head_node->prev == index) {
         return head;
     }
 
     // node is the head
-    if (head->id == node->id) {
-        return head->next;
+    if (head == index) {
+        return head_node->next;
     }
 
     // connect node's prev and next to each other
-    if (node->next) {
-        node->next->prev = node->prev;
+    if (node->next != HR_NULL_NODE) {
+        get_node(cache, node->next)->prev = node->prev;
     }
-    if (node->prev) {
-        node->prev->next = node->next;
+    if (node->prev != HR_NULL_NODE) {
+        get_node(cache, node->prev)->next = node->next;
     }
-    
-    HR_CacheNode* end = head->prev;
-    end->next = node;
+
+    int32_t end = head_node->prev;
+    get_node(cache, end)->next = index;
     node->prev = end;
     node->next = head;
-    head->prev = node;
+    head_node->prev = index;
     return head;
 }
 
-HR_CacheNode* remove_node(HR_CacheNode* head, HR_CacheNode* node) {
+int32_t remove_node(HR_Cache* cache, int32_t head, int32_t index) {
     // if head or node is NULL, return
-    if (!head || !node) {
+    if (head == HR_NULL_NODE || index == HR_NULL_NODE) {
         return head;
     }
 
+    HR_CacheNode* node = get_node(cache, index);
     // node is the head
-    if (head->id == node->id) {
-        HR_CacheNode* new_head = head->next;
-        if (new_head->id == node->id) {
-            return NULL;
+    if (head == index) {
+        int32_t new_head = node->next;
+        if (new_head == index) {
+            return HR_NULL_NODE;
         }
 
-        new_head->prev = head->prev;
-        head->prev->next = new_head;
+        get_node(cache, new_head)->prev = node->prev;
+        get_node(cache, node->prev)->next = new_head;
         return new_head;
     }
 
-    node->next->prev = node->prev;
-    node->prev->next = node->next;
+    get_node(cache, node->next)->prev = node->prev;
+    get_node(cache, node->prev)->next = node->next;
     return head;
 }
 
-void evict(HR_Cache* cache, HR_LookupAdmitResult* result) {
-    HR_CacheNode* node;
-    if (cache->cold_cache) {
-        node = cache->cold_cache;
-        cache->cold_cache = remove_node(node, node);
-    } else if (cache->hot_cache) {
-        node = cache->hot_cache;
-        cache->hot_cache = remove_node(node, node);
+// Called before a node leaves its place in its list. The demotion cursor falls back to the node
+// before it, the rescoring cursors go on to the node after it
+void release_cursors(HR_Cache* cache, int32_t index) {
+    HR_CacheNode* node = get_node(cache, index);
+    if (cache->demotion_cursor == index) {
+        cache->demotion_cursor = index == cache->cold_cache ? HR_NULL_NODE : node->prev;
+    }
+    if (cache->cold_rescore_cursor == index) {
+        cache->cold_rescore_cursor = node->next != index ? node->next : HR_NULL_NODE;
+    }
+    if (cache->hot_rescore_cursor == index) {
+        cache->hot_rescore_cursor = node->next != index ? node->next : HR_NULL_NODE;
     }
+}
 
+// Takes the node out of its list, the lookup table and the expiry wheel, and frees it
+void remove_cached_node(HR_Cache* cache, int32_t index) {
+    HR_CacheNode* node = get_node(cache, index);
     cache->current_size -= node->size;
+    release_cursors(cache, index);
     if (node->mode == HOT) {
+        cache->hot_cache = remove_node(cache, cache->hot_cache, index);
         cache->current_hot_size -= node->size;
+    } else {
+        cache->cold_cache = remove_node(cache, cache->cold_cache, index);
+        cache->current_cold_size -= node->size;
+    }
+
+    if (cache->expirations) {
+        timing_wheel_cancel(cache->expirations, index);
+    }
+    lookup_table_erase(cache->lookup_table, node->id);
+    free_node(cache, index);
+}
+
+void evict(HR_Cache* cache, HR_LookupAdmitResult* result) {
+    int32_t index = cache->cold_cache != HR_NULL_NODE ? cache->cold_cache : cache->hot_cache;
+    HR_CacheNode* node = get_node(cache, index);
+    if (node->mode == HOT) {
         result->hot_evictions_count++;
         result->hot_evictions_bytes += node->size;
     } else {
-        cache->current_cold_size -= node->size;
         result->cold_evictions_count++;
         result->cold_evictions_bytes += node->size;
     }
+    remove_cached_node(cache, index);
+}
 
-    node->next = NULL;
-    node->prev = NULL;
-    cache->lookup_table.erase(node->id);
-    delete node;
+// The last_seen of a node moving to the end of a list. Requests replayed out of order are stamped
+// with the latest timestamp seen so far instead of their own, which keeps both lists sorted
+static double stamp_last_seen(HR_Cache* cache, double timestamp) {
+    cache->latest_seen = std::max(cache->latest_seen, timestamp);
+    return cache->latest_seen;
 }
 
 void admit(HR_Cache* cache, HR_Request* request, HR_LookupAdmitResult* result) {
@@ -136,58 +199,68 @@ void admit(HR_Cache* cache, HR_Request* request, HR_LookupAdmitResult* result) {
     }
 
     result->admitted = true;
-    HR_CacheNode* node = create_node(request->object_id, request->size, request->timestamp);
-    while (cache->current_size + node->size > cache->capacity) {
+    while (cache->current_size + request->size > cache->capacity) {
         evict(cache, result);
     }
 
-    cache->lookup_table[node->id] = node;
+    int32_t index = create_node(cache, request->object_id, request->size, stamp_last_seen(cache, request->timestamp));
+    HR_CacheNode* node = get_node(cache, index);
+    lookup_table_insert(cache->lookup_table, node->id, index);
     if (request->admit_probability >= cache->hot_lower_bound) {
         node->mode = HOT;
-        cache->hot_cache = move_node_to_end(cache->hot_cache, node);
+        cache->hot_cache = move_node_to_end(cache, cache->hot_cache, index);
         cache->current_hot_size += node->size;
     } else {
         node->mode = COLD;
-        cache->cold_cache = move_node_to_end(cache->cold_cache, node);
+        cache->cold_cache = move_node_to_end(cache, cache->cold_cache, index);
         cache->current_cold_size += node->size;
     }
     cache->current_size += node->size;
 }
 
 HR_CacheNode* lookup_without_move(HR_Cache* cache, int request_id) {
-    return cache->lookup_table[request_id];
+    int32_t index = lookup_table_find(cache->lookup_table, request_id);
+    if (index == HR_NULL_NODE) {
+        return NULL;
+    }
+    return get_node(cache, index);
 }
 
 HR_CacheNode* lookup(HR_Cache* cache, HR_Request* request) {
-    HR_CacheNode *node = lookup_without_move(cache, request->object_id);
-    if (!node) {
+    int32_t index = lookup_table_find(cache->lookup_table, request->object_id);
+    if (index == HR_NULL_NODE) {
         return NULL;
     }
 
+    HR_CacheNode *node = get_node(cache, index);
     if (node->mode == HOT && request->admit_probability >= cache->hot_lower_bound) {
-        node->last_seen = request->timestamp;
-        cache->hot_cache = move_node_to_end(cache->hot_cache, node);
+        node->last_seen = stamp_last_seen(cache, request->timestamp);
+        release_cursors(cache, index);
+        cache->hot_cache = move_node_to_end(cache, cache->hot_cache, index);
     } else if (node->mode == HOT) {
-        node->last_seen = request->timestamp;
-        cache->hot_cache = remove_node(cache->hot_cache, node);
+        node->last_seen = stamp_last_seen(cache, request->timestamp);
+        release_cursors(cache, index);
+        cache->hot_cache = remove_node(cache, cache->hot_cache, index);
         cache->current_hot_size -= node->size;
         node->mode = COLD;
-        node->next = NULL;
-        node->prev = NULL;
-        cache->cold_cache = move_node_to_end(cache->cold_cache, node);
+        node->next = HR_NULL_NODE;
+        node->prev = HR_NULL_NODE;
+        cache->cold_cache = move_node_to_end(cache, cache->cold_cache, index);
         cache->current_cold_size += node->size;
     } else if (node->mode == COLD && request->admit_probability >= cache->hot_lower_bound) {
-        node->last_seen = request->timestamp;
-        cache->cold_cache = remove_node(cache->cold_cache, node);
+        node->last_seen = stamp_last_seen(cache, request->timestamp);
+        release_cursors(cache, index);
+        cache->cold_cache = remove_node(cache, cache->cold_cache, index);
         cache->current_cold_size -= node->size;
         node->mode = HOT;
-        node->next = NULL;
-        node->prev = NULL;
-        cache->hot_cache = move_node_to_end(cache->hot_cache, node);
+        node->next = HR_NULL_NODE;
+        node->prev = HR_NULL_NODE;
+        cache->hot_cache = move_node_to_end(cache, cache->hot_cache, index);
         cache->current_hot_size += node->size;
     } else if (node->mode == COLD && request->admit_probability >= cache->cold_lower_bound) {
-        node->last_seen = request->timestamp;
-        cache->cold_cache = move_node_to_end(cache->cold_cache, node);
+        node->last_seen = stamp_last_seen(cache, request->timestamp);
+        release_cursors(cache, index);
+        cache->cold_cache = move_node_to_end(cache, cache->cold_cache, index);
     }
 
     return node;
@@ -213,90 +286,204 @@ HR_LookupAdmitResult lookup_and_admit(HR_Cache* cache, HR_Request* request) {
     return result;
 }
 
-int cleanup_expired_hot(HR_Cache* cache, double last_seen_threshold) {
-    int counter = 0;
-    HR_CacheNode *cold_node = cache->cold_cache;
-    while (cache->hot_cache) {
-        if (cache->hot_cache->last_seen > last_seen_threshold) {
+// Restarts the time to live of the requested object, if it is cached, from its predicted probability
+void schedule_expiry(HR_Cache* cache, HR_Request* request) {
+    if (!cache->expirations) {
+        return;
+    }
+    int32_t index = lookup_table_find(cache->lookup_table, request->object_id);
+    if (index != HR_NULL_NODE) {
+        timing_wheel_schedule(cache->expirations, index, request->timestamp + cache->max_ttl * request->admit_probability);
+    }
+}
+
+// Removes the entries whose time to live ran out by timestamp, returns how many
+int expire_cache(HR_Cache* cache, double timestamp, long long* expired_bytes) {
+    if (!cache->expirations) {
+        return 0;
+    }
+    int count = 0;
+    int32_t index;
+    while (timing_wheel_next_due(cache->expirations, timestamp, &index)) {
+        *expired_bytes += get_node(cache, index)->size;
+        remove_cached_node(cache, index);
+        count++;
+    }
+    return count;
+}
+
+// Links the node into the cold list right after prev, or first when prev is HR_NULL_NODE
+static void link_cold_after(HR_Cache* cache, int32_t index, int32_t prev) {
+    HR_CacheNode* node = get_node(cache, index);
+    if (cache->cold_cache == HR_NULL_NODE) {
+        node->next = index;
+        node->prev = index;
+        cache->cold_cache = index;
+        return;
+    }
+
+    bool first = prev == HR_NULL_NODE;
+    if (first) {
+        prev = get_node(cache, cache->cold_cache)->prev;
+    }
+    HR_CacheNode* prev_node = get_node(cache, prev);
+    node->prev = prev;
+    node->next = prev_node->next;
+    get_node(cache, prev_node->next)->prev = index;
+    prev_node->next = index;
+    if (first) {
+        cache->cold_cache = index;
+    }
+}
+
+int demote_stale_hot(HR_Cache* cache, double last_seen_threshold, int max_steps) {
+    int demoted = 0;
+    int steps = 0;
+    while (cache->hot_cache != HR_NULL_NODE && steps < max_steps) {
+        int32_t index = cache->hot_cache;
+        HR_CacheNode* node = get_node(cache, index);
+        // The hot list stays sorted by last_seen, see stamp_last_seen, so no stale node is left
+        // past the first fresh one
+        if (node->last_seen > last_seen_threshold) {
             break;
         }
 
-        counter++;
-        HR_CacheNode* node = cache->hot_cache;
-        cache->hot_cache = remove_node(cache->hot_cache, node);
+        // The hot list is demoted oldest first, so the insertion point only moves forward; the walk
+        // stops at the first newer cold node
+        int32_t next = cache->demotion_cursor == HR_NULL_NODE ? cache->cold_cache : get_node(cache, cache->demotion_cursor)->next;
+        bool found = false;
+        while (!found && steps < max_steps) {
+            if (next == HR_NULL_NODE || (cache->demotion_cursor != HR_NULL_NODE && next == cache->cold_cache)) {
+                found = true;
+            } else if (get_node(cache, next)->last_seen > node->last_seen) {
+                found = true;
+            } else {
+                cache->demotion_cursor = next;
+                next = get_node(cache, next)->next;
+                steps++;
+            }
+        }
+        if (!found) {
+            break;
+        }
+
+        release_cursors(cache, index);
+        cache->hot_cache = remove_node(cache, cache->hot_cache, index);
         cache->current_hot_size -= node->size;
         node->mode = COLD;
-
+        link_cold_after(cache, index, cache->demotion_cursor);
         cache->current_cold_size += node->size;
-        if (!cold_node) {
-            cache->cold_cache = node;
-            node->next = node;
-            node->prev = node;
-            cache->current_cold_size += node->size;
-            cold_node = node;
-        } else {
-            while (cold_node) {
-                if (node->last_seen < cold_node->last_seen) {
-                    if (cold_node == cache->cold_cache) {
-                        cache->cold_cache = node;
-                    }
-
-                    node->next = cold_node;
-                    node->prev = cold_node->prev;
-                    cold_node->prev->next = node;
-                    cold_node->prev = node;
-                    break;
-                }
-                    
-                if (cold_node->next == cache->cold_cache) {
-                    node->next = cold_node->next;
-                    node->prev = cold_node;
-                    cold_node->next->prev = node;
-                    cold_node->next = node;
-                    cold_node = node;
-                    break;
-                }
-
-                cold_node = cold_node->next;
-            }
-        }
+        cache->demotion_cursor = index;
+        demoted++;
+        steps++;
     }
-    return counter;
+    return demoted;
 }
 
-void cleanup_cache(HR_Cache* cache, HR_Model* model, int period) {
-    if (!cache->cold_cache) {
-        return;
-    }
-    
-    HR_CacheNode* cold_start = cache->cold_cache;
-    HR_CacheNode** nodes = new HR_CacheNode*[period];
-    HR_CacheNode* node = cache->cold_cache;
-    int nodes_count;
-    while (nodes_count < period) {
-        nodes[nodes_count++] = node;
-        node = node->next;
-        if (node == cold_start) {
-            break;
+// Links demoted nodes, sorted from the latest seen, into the cold list by last_seen. A single walk
+// goes back from the tail to the last cold node seen at or before each of them. It never passes the
+// demotion cursor, which is seen before any hot node, so demote_stale_hot's insertion point holds.
+// The walk takes max_steps nodes at most; the nodes left then go right after the demotion cursor,
+// ahead of their place, and are evicted earlier than their last_seen alone would have them.
+static void merge_demoted_from_tail(HR_Cache* cache, const int32_t* nodes, int count, int max_steps) {
+    int32_t position = cache->cold_cache != HR_NULL_NODE ? get_node(cache, cache->cold_cache)->prev : HR_NULL_NODE;
+    int steps = 0;
+    for (int i = 0; i < count; i++) {
+        int32_t index = nodes[i];
+        double last_seen = get_node(cache, index)->last_seen;
+        while (steps < max_steps && position != HR_NULL_NODE && get_node(cache, position)->last_seen > last_seen) {
+            position = position == cache->cold_cache ? HR_NULL_NODE : get_node(cache, position)->prev;
+            steps++;
+        }
+        if (position != HR_NULL_NODE && get_node(cache, position)->last_seen > last_seen) {
+            link_cold_after(cache, index, cache->demotion_cursor);
+        } else {
+            link_cold_after(cache, index, position);
+            position = index;
         }
     }
 }
 
-void destroy_nodes(HR_CacheNode* node) {
-    if (!node) {
+// Appends up to count nodes to the batch starting at the cursor, going around the list once at most;
+// the cursor moves to the first node left out
+static void gather_rescore_batch(HR_Cache* cache, int32_t head, int32_t* cursor, int count) {
+    if (head == HR_NULL_NODE || count <= 0) {
         return;
     }
-
-    HR_CacheNode* first = node;
+    int32_t start = *cursor != HR_NULL_NODE ? *cursor : head;
+    int32_t index = start;
     do {
-        HR_CacheNode* tmp = node;
-        node = node->next;
-        delete tmp;
-    } while (node != first);
+        cache->rescore_nodes.push_back(index);
+        index = get_node(cache, index)->next;
+    } while (--count > 0 && index != start);
+    *cursor = index;
+}
+
+HR_CleanupResult cleanup_cache(HR_Cache* cache, HR_Model* model, HR_ObjectsMetadata* objects_metadata, int budget, bool with_hot) {
+    HR_CleanupResult result;
+    result.rescored_count = 0;
+    result.evictions_count = 0;
+    result.evictions_bytes = 0;
+    result.demotions_count = 0;
+
+    cache->rescore_nodes.clear();
+    int hot_budget = with_hot && cache->hot_cache != HR_NULL_NODE ? budget / 2 : 0;
+    gather_rescore_batch(cache, cache->cold_cache, &cache->cold_rescore_cursor, budget - hot_budget);
+    gather_rescore_batch(cache, cache->hot_cache, &cache->hot_rescore_cursor, hot_budget);
+
+    // Objects the metadata no longer tracks have no features to score them with and are left alone
+    int features_length = objects_metadata->features_length;
+    cache->rescore_features.resize(cache->rescore_nodes.size() * features_length);
+    int count = 0;
+    for (int32_t index : cache->rescore_nodes) {
+        const HR_FeatureValue* features = objects_metadata->get_features(get_node(cache, index)->id);
+        if (features) {
+            std::copy(features, features + features_length, cache->rescore_features.data() + static_cast<long long>(count) * features_length);
+            cache->rescore_nodes[count++] = index;
+        }
+    }
+    if (count == 0) {
+        return result;
+    }
+    cache->rescore_nodes.resize(count);
+    cache->rescore_probabilities.resize(count);
+    predict_requests(model, cache->rescore_features.data(), count, cache->rescore_probabilities.data());
+    result.rescored_count = count;
+
+    // Demoted nodes are unlinked here and merged into the cold list together, in place of the batch
+    int demoted = 0;
+    for (int i = 0; i < count; i++) {
+        int32_t index = cache->rescore_nodes[i];
+        HR_CacheNode* node = get_node(cache, index);
+        double probability = cache->rescore_probabilities[i];
+        if (probability < cache->cold_lower_bound) {
+            result.evictions_count++;
+            result.evictions_bytes += node->size;
+            remove_cached_node(cache, index);
+        } else if (node->mode == HOT && probability < cache->hot_lower_bound) {
+            release_cursors(cache, index);
+            cache->hot_cache = remove_node(cache, cache->hot_cache, index);
+            cache->current_hot_size -= node->size;
+            node->mode = COLD;
+            cache->current_cold_size += node->size;
+            cache->rescore_nodes[demoted++] = index;
+        }
+    }
+    std::sort(cache->rescore_nodes.begin(), cache->rescore_nodes.begin() + demoted, [cache](int32_t a, int32_t b) {
+        return get_node(cache, a)->last_seen > get_node(cache, b)->last_seen;
+    });
+    merge_demoted_from_tail(cache, cache->rescore_nodes.data(), demoted, budget);
+    result.demotions_count = demoted;
+    return result;
 }
 
 void destroy_lru_cache(HR_Cache* cache) {
-    destroy_nodes(cache->hot_cache);
-    destroy_nodes(cache->cold_cache);
+    for (HR_CacheNode* slab : cache->pool.slabs) {
+        delete[] slab;
+    }
+    destroy_lookup_table(cache->lookup_table);
+    if (cache->expirations) {
+        destroy_timing_wheel(cache->expirations);
+    }
     delete cache;
-}
\ No newline at end of file
+}
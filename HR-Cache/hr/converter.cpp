@@ -0,0 +1,41 @@
+#include "trace.h"
+#include <iostream>
+#include <cstring>
+#include <string>
+
+// Converts a text trace ("timestamp object_id size" per line) into the binary trace format
+int main(int argc, char* argv[]) {
+    std::string input_path, output_path;
+    bool delta = false;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg.find("--input=") == 0) {
+            input_path = arg.substr(strlen("--input="));
+        }
+        if (arg.find("--output=") == 0) {
+            output_path = arg.substr(strlen("--output="));
+        }
+        if (arg.find("--delta") == 0) {
+            if (arg.find("--delta=") == 0) {
+                delta = arg.substr(strlen("--delta=")) == "true";
+            } else {
+                delta = true;
+            }
+        }
+    }
+
+    if (input_path.empty() || output_path.empty()) {
+        std::cerr << "Usage: " << argv[0] << " --input=<trace> --output=<binary trace> [--delta]" << std::endl;
+        return 1;
+    }
+
+    HR_Trace* trace = open_trace(input_path);
+    if (!trace) {
+        return 1;
+    }
+    bool written = write_trace(trace, output_path, delta);
+    std::cout << "Requests: " << trace->header.requests_count << std::endl;
+    close_trace(trace);
+    return written ? 0 : 1;
+}
@@ -0,0 +1,287 @@
+#include "forest.h"
+#include <stdlib.h>
+#include <string.h>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include <limits>
+
+// LightGBM's kZeroThreshold, a float literal widened to double
+const double FOREST_ZERO_THRESHOLD = 1e-35f;
+// Rows scored together, tree by tree, so that a tree stays in cache for the whole block
+const int FOREST_BLOCK_ROWS = 256;
+// Rows walking down a tree in lockstep, their independent decisions overlap
+const int FOREST_LANES = 8;
+
+struct HR_ForestTree {
+    int leaves_count;
+    std::vector<int> split_features;
+    std::vector<double> thresholds;
+    std::vector<int> decision_types;
+    std::vector<int> left_children;
+    std::vector<int> right_children;
+    std::vector<double> leaf_values;
+};
+
+template <typename T>
+static void parse_values(const char* text, std::vector<T>& values) {
+    values.clear();
+    char* end;
+    while (true) {
+        double value = strtod(text, &end);
+        if (end == text) {
+            return;
+        }
+        values.push_back(static_cast<T>(value));
+        text = end;
+    }
+}
+
+static bool valid_tree(const HR_ForestTree& tree, int features_length) {
+    int splits_count = tree.leaves_count - 1;
+    if (tree.leaves_count < 1 || static_cast<int>(tree.leaf_values.size()) != tree.leaves_count
+        || static_cast<int>(tree.split_features.size()) != splits_count
+        || static_cast<int>(tree.thresholds.size()) != splits_count
+        || static_cast<int>(tree.decision_types.size()) != splits_count
+        || static_cast<int>(tree.left_children.size()) != splits_count
+        || static_cast<int>(tree.right_children.size()) != splits_count) {
+        return false;
+    }
+    for (int i = 0; i < splits_count; i++) {
+        // bit 0 marks categorical splits
+        if (tree.decision_types[i] & 1 || tree.split_features[i] < 0 || tree.split_features[i] >= features_length) {
+            return false;
+        }
+        int children[2] = {tree.left_children[i], tree.right_children[i]};
+        for (int child : children) {
+            if (child >= splits_count || ~child >= tree.leaves_count) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// Reads the trees of a LightGBM model text, false if the model has anything the forest cannot represent
+static bool parse_model(const std::string& model, int features_length, std::vector<HR_ForestTree>& trees, double* sigmoid) {
+    bool binary = false;
+    bool in_tree = false;
+    size_t position = 0;
+    while (position < model.size()) {
+        size_t line_end = model.find('\n', position);
+        if (line_end == std::string::npos) {
+            line_end = model.size();
+        }
+        std::string line = model.substr(position, line_end - position);
+        position = line_end + 1;
+
+        if (line == "end of trees") {
+            break;
+        }
+        size_t separator = line.find('=');
+        if (separator == std::string::npos) {
+            continue;
+        }
+        std::string key = line.substr(0, separator);
+        const char* value = line.c_str() + separator + 1;
+
+        if (key == "objective") {
+            binary = strncmp(value, "binary", strlen("binary")) == 0;
+            const char* sigmoid_value = strstr(value, "sigmoid:");
+            *sigmoid = sigmoid_value ? strtod(sigmoid_value + strlen("sigmoid:"), NULL) : 1;
+        } else if (key == "Tree") {
+            trees.emplace_back();
+            trees.back().leaves_count = 0;
+            in_tree = true;
+        } else if (!in_tree) {
+            continue;
+        } else if (key == "num_leaves") {
+            trees.back().leaves_count = atoi(value);
+        } else if (key == "num_cat") {
+            if (atoi(value) != 0) {
+                return false;
+            }
+        } else if (key == "is_linear") {
+            if (atoi(value) != 0) {
+                return false;
+            }
+        } else if (key == "split_feature") {
+            parse_values(value, trees.back().split_features);
+        } else if (key == "threshold") {
+            parse_values(value, trees.back().thresholds);
+        } else if (key == "decision_type") {
+            parse_values(value, trees.back().decision_types);
+        } else if (key == "left_child") {
+            parse_values(value, trees.back().left_children);
+        } else if (key == "right_child") {
+            parse_values(value, trees.back().right_children);
+        } else if (key == "leaf_value") {
+            parse_values(value, trees.back().leaf_values);
+        }
+    }
+
+    if (!binary || trees.empty()) {
+        return false;
+    }
+    for (const HR_ForestTree& tree : trees) {
+        if (!valid_tree(tree, features_length)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static int tree_depth(const HR_ForestTree& tree) {
+    if (tree.leaves_count == 1) {
+        return 0;
+    }
+    int depth = 0;
+    std::vector<std::pair<int, int>> stack = {{0, 1}};
+    while (!stack.empty()) {
+        std::pair<int, int> top = stack.back();
+        stack.pop_back();
+        depth = std::max(depth, top.second);
+        int children[2] = {tree.left_children[top.first], tree.right_children[top.first]};
+        for (int child : children) {
+            if (child >= 0) {
+                stack.push_back({child, top.second + 1});
+            }
+        }
+    }
+    return depth;
+}
+
+HR_Forest* create_forest(const std::string& model, int features_length) {
+    std::vector<HR_ForestTree> trees;
+    double sigmoid = 1;
+    if (!parse_model(model, features_length, trees, &sigmoid)) {
+        return NULL;
+    }
+
+    HR_Forest* forest = new HR_Forest;
+    forest->trees_count = trees.size();
+    forest->features_length = features_length;
+    forest->sigmoid = sigmoid;
+    forest->nodes_count = 0;
+    for (const HR_ForestTree& tree : trees) {
+        forest->nodes_count += 2 * tree.leaves_count - 1;
+    }
+    forest->roots = static_cast<int32_t*>(malloc(sizeof(int32_t) * forest->trees_count));
+    forest->depths = static_cast<int*>(malloc(sizeof(int) * forest->trees_count));
+    forest->nodes = static_cast<HR_ForestNode*>(malloc(sizeof(HR_ForestNode) * forest->nodes_count));
+    forest->leaf_values = static_cast<double*>(calloc(forest->nodes_count, sizeof(double)));
+
+    int offset = 0;
+    for (int t = 0; t < forest->trees_count; t++) {
+        const HR_ForestTree& tree = trees[t];
+        // the split nodes of the tree, then its leaves
+        int splits_count = tree.leaves_count - 1;
+        forest->roots[t] = offset;
+        forest->depths[t] = tree_depth(tree);
+
+        for (int i = 0; i < splits_count; i++) {
+            HR_ForestNode& node = forest->nodes[offset + i];
+            node.threshold = tree.thresholds[i];
+            node.feature = tree.split_features[i];
+            int children[2] = {tree.left_children[i], tree.right_children[i]};
+            for (int side = 0; side < 2; side++) {
+                node.children[side] = offset + (children[side] >= 0 ? children[side] : splits_count + ~children[side]);
+            }
+            // decision_type: bit 1 default left, bits 2-3 missing type
+            node.default_left = (tree.decision_types[i] >> 1) & 1;
+            node.missing_type = (tree.decision_types[i] >> 2) & 3;
+        }
+        for (int i = 0; i < tree.leaves_count; i++) {
+            int leaf = offset + splits_count + i;
+            HR_ForestNode& node = forest->nodes[leaf];
+            node.threshold = std::numeric_limits<double>::infinity();
+            node.feature = 0;
+            node.children[0] = leaf;
+            node.children[1] = leaf;
+            node.missing_type = HR_FOREST_MISSING_NONE;
+            node.default_left = 1;
+            forest->leaf_values[leaf] = tree.leaf_values[i];
+        }
+        offset += splits_count + tree.leaves_count;
+    }
+    return forest;
+}
+
+// LightGBM's NumericalDecision, after the predictor dropped the near-zero values of the row
+static inline int32_t forest_child(const HR_ForestNode* node, const HR_FeatureValue* row) {
+    double value = row[node->feature];
+    if (node->missing_type == HR_FOREST_MISSING_NONE) {
+        // near-zero values and NaNs both read as 0, without branching
+        value = std::fabs(value) > FOREST_ZERO_THRESHOLD ? value : 0.0;
+        return node->children[value <= node->threshold ? 0 : 1];
+    }
+
+    if (std::fabs(value) <= FOREST_ZERO_THRESHOLD) {
+        value = 0;
+    }
+    if (std::isnan(value) && node->missing_type != HR_FOREST_MISSING_NAN) {
+        value = 0;
+    }
+    if ((node->missing_type == HR_FOREST_MISSING_ZERO && value >= -FOREST_ZERO_THRESHOLD && value <= FOREST_ZERO_THRESHOLD)
+        || (node->missing_type == HR_FOREST_MISSING_NAN && std::isnan(value))) {
+        return node->children[node->default_left ? 0 : 1];
+    }
+    return node->children[value <= node->threshold ? 0 : 1];
+}
+
+static void score_tree(const HR_Forest* forest, int tree, const HR_FeatureValue* features, int rows_count, double* scores) {
+    const HR_ForestNode* nodes = forest->nodes;
+    int32_t root = forest->roots[tree];
+    int depth = forest->depths[tree];
+
+    int i = 0;
+    for (; i + FOREST_LANES <= rows_count; i += FOREST_LANES) {
+        const HR_FeatureValue* rows[FOREST_LANES];
+        int32_t positions[FOREST_LANES];
+        for (int lane = 0; lane < FOREST_LANES; lane++) {
+            rows[lane] = features + static_cast<long long>(i + lane) * forest->features_length;
+            positions[lane] = root;
+        }
+        for (int level = 0; level < depth; level++) {
+            for (int lane = 0; lane < FOREST_LANES; lane++) {
+                positions[lane] = forest_child(&nodes[positions[lane]], rows[lane]);
+            }
+        }
+        for (int lane = 0; lane < FOREST_LANES; lane++) {
+            scores[i + lane] += forest->leaf_values[positions[lane]];
+        }
+    }
+
+    for (; i < rows_count; i++) {
+        const HR_FeatureValue* row = features + static_cast<long long>(i) * forest->features_length;
+        int32_t position = root;
+        for (int level = 0; level < depth; level++) {
+            position = forest_child(&nodes[position], row);
+        }
+        scores[i] += forest->leaf_values[position];
+    }
+}
+
+void predict_forest(const HR_Forest* forest, const HR_FeatureValue* features, int rows_count, double* probabilities) {
+    for (int start = 0; start < rows_count; start += FOREST_BLOCK_ROWS) {
+        int count = std::min(FOREST_BLOCK_ROWS, rows_count - start);
+        const HR_FeatureValue* block = features + static_cast<long long>(start) * forest->features_length;
+        double* scores = probabilities + start;
+
+        std::fill(scores, scores + count, 0.0);
+        for (int t = 0; t < forest->trees_count; t++) {
+            score_tree(forest, t, block, count, scores);
+        }
+        for (int i = 0; i < count; i++) {
+            scores[i] = 1.0 / (1.0 + std::exp(-forest->sigmoid * scores[i]));
+        }
+    }
+}
+
+void destroy_forest(HR_Forest* forest) {
+    free(forest->roots);
+    free(forest->depths);
+    free(forest->nodes);
+    free(forest->leaf_values);
+    delete forest;
+}
@@ -0,0 +1,109 @@
+#include "hazard_index.h"
+#include <stdlib.h>
+#include <string.h>
+#include <cmath>
+#include <limits>
+
+HR_HazardIndex* create_hazard_index(int objects_count) {
+    HR_HazardIndex* index = new HR_HazardIndex;
+    index->tree = static_cast<long long*>(calloc(HR_HAZARD_INDEX_BUCKETS + 1, sizeof(long long)));
+    index->total_size = 0;
+    index->objects_count = objects_count;
+    index->buckets = static_cast<int*>(malloc(sizeof(int) * objects_count));
+    index->sizes = static_cast<int*>(calloc(objects_count, sizeof(int)));
+    index->versions = static_cast<uint32_t*>(calloc(objects_count, sizeof(uint32_t)));
+    for (int i = 0; i < objects_count; i++) {
+        index->buckets[i] = HR_HAZARD_INDEX_ABSENT;
+    }
+    return index;
+}
+
+int hazard_bucket(double hazard) {
+    if (!(hazard > 0)) {
+        return 0;
+    }
+
+    // hazard = mantissa * 2^exponent with mantissa in [0.5, 1), split linearly into sub buckets
+    int exponent;
+    double mantissa = std::frexp(hazard, &exponent);
+    if (exponent < HR_HAZARD_INDEX_MIN_EXPONENT) {
+        return 1;
+    }
+    if (exponent >= HR_HAZARD_INDEX_MAX_EXPONENT) {
+        return HR_HAZARD_INDEX_BUCKETS - 1;
+    }
+    int sub_bucket = static_cast<int>((2 * mantissa - 1) * HR_HAZARD_INDEX_SUB_BUCKETS);
+    return 1 + (exponent - HR_HAZARD_INDEX_MIN_EXPONENT) * HR_HAZARD_INDEX_SUB_BUCKETS + sub_bucket;
+}
+
+static void tree_add(HR_HazardIndex* index, int bucket, long long size) {
+    for (int i = bucket + 1; i <= HR_HAZARD_INDEX_BUCKETS; i += i & -i) {
+        index->tree[i] += size;
+    }
+}
+
+// Total size in the buckets below bucket
+static long long tree_prefix(const HR_HazardIndex* index, int bucket) {
+    long long size = 0;
+    for (int i = bucket; i > 0; i -= i & -i) {
+        size += index->tree[i];
+    }
+    return size;
+}
+
+void hazard_index_set(HR_HazardIndex* index, int object, int size, double hazard) {
+    int bucket = hazard_bucket(hazard);
+    int old_bucket = index->buckets[object];
+    if (old_bucket == bucket && index->sizes[object] == size) {
+        return;
+    }
+
+    if (old_bucket != HR_HAZARD_INDEX_ABSENT) {
+        tree_add(index, old_bucket, -index->sizes[object]);
+        index->total_size -= index->sizes[object];
+    }
+    tree_add(index, bucket, size);
+    index->total_size += size;
+    index->buckets[object] = bucket;
+    index->sizes[object] = size;
+}
+
+long long hazard_index_size_at_least(const HR_HazardIndex* index, double hazard) {
+    return index->total_size - tree_prefix(index, hazard_bucket(hazard));
+}
+
+// Replaces the pending refresh of the object, an infinite time only cancels it
+void hazard_index_schedule(HR_HazardIndex* index, int object, double time) {
+    index->versions[object]++;
+    if (time == std::numeric_limits<double>::infinity()) {
+        return;
+    }
+
+    HR_HazardRefresh refresh;
+    refresh.time = time;
+    refresh.object = object;
+    refresh.version = index->versions[object];
+    index->refreshes.push(refresh);
+}
+
+// Pops the next object whose refresh is due at time; its schedule is consumed
+bool hazard_index_next_due(HR_HazardIndex* index, double time, int* object) {
+    while (!index->refreshes.empty() && index->refreshes.top().time <= time) {
+        HR_HazardRefresh refresh = index->refreshes.top();
+        index->refreshes.pop();
+        if (refresh.version == index->versions[refresh.object]) {
+            index->versions[refresh.object]++;
+            *object = refresh.object;
+            return true;
+        }
+    }
+    return false;
+}
+
+void destroy_hazard_index(HR_HazardIndex* index) {
+    free(index->tree);
+    free(index->buckets);
+    free(index->sizes);
+    free(index->versions);
+    delete index;
+}
@@ -13,10 +13,10 @@
 #include <filesystem>
 #include <chrono>
 #include <ctime>
+#include <sys/resource.h>
 
 const int CONCURRENCY = 100;
 
-const long long CACHE_SIZE = 3941722;
 const double CACHE_HOT_LOWER_BOUND = 0.5;
 const double CACHE_COLD_LOWER_BOUND = 0.0;
 const bool CACHE_EVICT_HOT_FOR_COLD = true;
@@ -24,9 +24,20 @@ const bool CACHE_EVICT_HOT_FOR_COLD = true;
 const int FEATURES_LENGTH = 32;
 const double HAZARD_BANDWIDTH = 3;
 const bool HAZARD_DISCRETE = true;
+const double HAZARD_MAX_ERROR = 0.05;         // 0 computes every hazard exactly
 const bool FUTURE_LABELING = true;
 const bool ONE_TIME_TRAINING = false;
+const HR_RetrainMode RETRAIN_MODE = RETRAIN_SYNC;
 const int MAX_BOOST_ROUNDS = 100;
+const int INCREMENTAL_BOOST_ROUNDS = 0;
+const int FULL_REBUILD_INTERVAL = 8;
+const double MAX_TTL = 0;                   // in trace time, 0 to never expire entries
+const double HOT_MAX_IDLE = 12 * 60 * 60;   // trace time after which an untouched hot entry is demoted
+const int DEMOTION_STEPS = 16;              // cold list nodes walked per request at most while demoting
+const int RESCORE_BUDGET = 0;
+const bool RESCORE_HOT = false;
+const HR_PredictMode PREDICT_MODE = PREDICT_SYNC;  // the pipeline is opt-in, it starts a thread per cache
+const double PREDICT_LATENCY_TARGET = 200;  // microseconds per prediction batch
 const std::unordered_map<HR_FEATURE, bool> FEATURES = {
     {FEAT_FREQUENCY, false},
     {FEAT_SIZE, true},
@@ -58,7 +69,19 @@ HRCache* create_hr(
     std::optional<int> report_interval,
     std::optional<bool> log_file,
     std::optional<bool> log_requests,
-    std::optional<std::string> log_file_name
+    std::optional<std::string> log_file_name,
+    std::optional<HR_RetrainMode> retrain_mode,
+    std::optional<int> incremental_boost_rounds,
+    std::optional<int> full_rebuild_interval,
+    std::optional<double> max_ttl,
+    std::optional<int> rescore_budget,
+    std::optional<bool> rescore_hot,
+    std::optional<HR_PredictMode> predict_mode,
+    std::optional<double> predict_latency_target,
+    std::optional<double> hazard_max_error,
+    std::optional<double> hot_max_idle,
+    std::optional<int> demotion_steps,
+    HR_Model* shared_model
 ) {
     HRCache* hr = new HRCache;
     hr->key = key;
@@ -67,14 +90,17 @@ HRCache* create_hr(
         cache_size.value_or(CACHE_SIZE),
         cache_hot_lower_bound.value_or(CACHE_HOT_LOWER_BOUND),
         cache_cold_lower_bound.value_or(CACHE_COLD_LOWER_BOUND),
-        cache_evict_hot_for_cold.value_or(CACHE_EVICT_HOT_FOR_COLD)
+        cache_evict_hot_for_cold.value_or(CACHE_EVICT_HOT_FOR_COLD),
+        max_ttl.value_or(MAX_TTL)
     );
     hr->concurrency = concurrency.value_or(CONCURRENCY);
+    hr->rescore_budget = rescore_budget.value_or(RESCORE_BUDGET);
+    hr->rescore_hot = rescore_hot.value_or(RESCORE_HOT);
 
     std::unordered_map<HR_FEATURE, bool> final_features = features.value_or(FEATURES);
     int final_features_length = features_length.value_or(FEATURES_LENGTH);
     double final_decay_factor = final_features.at(FEAT_DECAYED_FREQUENCY) ? decay_factor.value_or(DECAY_FACTOR) : 0;
-    hr->last_processed_request = NULL;
+    hr->last_processed_request = -1;
 
     hr->objects_metadata = new HR_ObjectsMetadata(
         static_cast<int>(hr->lru_cache->capacity * 0.02),
@@ -88,18 +114,39 @@ HRCache* create_hr(
         final_features,
         hr->objects_metadata
     );
-    hr->model = create_hr_model(
+    hr->owns_model = !shared_model;
+    hr->labeling_threads = 0;
+    hr->model = shared_model ? shared_model : create_hr_model(
         static_cast<int>(hr->lru_cache->capacity * 0.03),
         hr->request_window->features_length,
-        max_boost_rounds.value_or(MAX_BOOST_ROUNDS)
+        max_boost_rounds.value_or(MAX_BOOST_ROUNDS),
+        incremental_boost_rounds.value_or(INCREMENTAL_BOOST_ROUNDS),
+        full_rebuild_interval.value_or(FULL_REBUILD_INTERVAL)
     );
 
+    hr->request_latencies = create_latency_histograms();
+    hr->training_latencies = create_latency_histograms();
+    hr->latencies_snapshot = new HR_LatencySnapshot();
+    hr->previous_latencies_snapshot = new HR_LatencySnapshot();
+    hr->reported_clock = std::clock();
+    hr->predict_mode = predict_mode.value_or(PREDICT_MODE);
+    hr->predictor = hr->predict_mode == PREDICT_PIPELINE ? create_predictor(
+        hr->model,
+        hr->request_window->features_length,
+        predict_latency_target.value_or(PREDICT_LATENCY_TARGET) / 1e6
+    ) : NULL;
+
     hr->learning_rate = learning_rate.value_or(DEFAULT_LEARNING_RATE);
     hr->hazard_bandwidth = hazard_bandwidth.value_or(HAZARD_BANDWIDTH);
     hr->hazard_discrete = hazard_discrete.value_or(HAZARD_DISCRETE);
+    hr->hazard_max_error = hazard_max_error.value_or(HAZARD_MAX_ERROR);
     hr->future_labeling = future_labeling.value_or(FUTURE_LABELING);
     hr->one_time_training = one_time_training.value_or(ONE_TIME_TRAINING);
+    hr->retrain_mode = retrain_mode.value_or(RETRAIN_MODE);
+    hr->training = false;
+    hr->skipped_windows = 0;
     hr->report_interval = report_interval.value_or(REPORT_INTERVAL);
+    hr->log_console = true;
     hr->log_file = log_file.value_or(false);
     hr->log_requests = log_requests.value_or(false);
     hr->requests_count = 0;
@@ -114,6 +161,17 @@ HRCache* create_hr(
     hr->analytics_hot_evicted_reqs = 0;
     hr->analytics_cold_evicted_bytes = 0;
     hr->analytics_cold_evicted_reqs = 0;
+    hr->cumulative_expired_bytes = 0;
+    hr->cumulative_expired_reqs = 0;
+    hr->cumulative_demoted_reqs = 0;
+    hr->hot_max_idle = hot_max_idle.value_or(HOT_MAX_IDLE);
+    hr->demotion_steps = demotion_steps.value_or(DEMOTION_STEPS);
+    hr->cumulative_rescored_reqs = 0;
+    hr->cumulative_rescore_evicted_reqs = 0;
+    hr->cumulative_rescore_evicted_bytes = 0;
+    hr->cumulative_rescore_demoted_reqs = 0;
+    hr->analytics_expired_bytes = 0;
+    hr->analytics_expired_reqs = 0;
     hr->cumulative_reqs = 0;
     hr->cumulative_reqs_hits = 0;
     hr->cumulative_times = 0;
@@ -127,6 +185,7 @@ HRCache* create_hr(
     hr->analytics_bytes = 0;
     hr->analytics_bytes_hit = 0;
     hr->analytics_round = 0;
+    hr->analytics_stream = NULL;
 
     if (hr->log_requests) {
         hr->requests_file.open("requests.txt");
@@ -139,19 +198,44 @@ HRCache* create_hr(
 
         hr->analytics_file.open(filename, std::ios::app);
         hr->analytics_file << std::setprecision(15);
+        hr->analytics_stream = &hr->analytics_file;
 
         if (!file_exists) {
-            hr->analytics_file << "key,cache_size,cache_hot_lower_bound,cache_cold_lower_bound,cache_evict_hot_for_cold,";
-            hr->analytics_file << "window_size,learning_rate,features_length,feature_size,feature_frequency,feature_decayed_frequency,";
-            hr->analytics_file << "hazard_bandwidth,hazard_discrete,future_labeling,one_time_training,max_boost_rounds,";
-            hr->analytics_file << "report_interval,analytics_round,miss_bytes_percentage,miss_percentage,cumulative_miss_bytes_percentage,";
-            hr->analytics_file << "cumulative_miss_percentage" << std::endl;
+            write_analytics_header(hr->analytics_file);
         }
     }
 
     return hr;
 }
 
+void write_analytics_header(std::ostream& out) {
+    out << "key,cache_size,cache_hot_lower_bound,cache_cold_lower_bound,cache_evict_hot_for_cold,";
+    out << "window_size,learning_rate,features_length,feature_size,feature_frequency,feature_decayed_frequency,";
+    out << "hazard_bandwidth,hazard_discrete,future_labeling,one_time_training,max_boost_rounds,";
+    out << "report_interval,analytics_round,miss_bytes_percentage,miss_percentage,cumulative_miss_bytes_percentage,";
+    out << "cumulative_miss_percentage" << std::endl;
+}
+
+void write_analytics_row(
+    std::ostream& out,
+    HRCache* hr,
+    double miss_bytes_percentage,
+    double miss_percentage,
+    double cumulative_miss_bytes_percentage,
+    double cumulative_miss_percentage
+) {
+    int window_size = hr->request_window->size ? *hr->request_window->size : 0;
+    out << hr->key << "," << hr->lru_cache->capacity << "," << hr->lru_cache->hot_lower_bound << ",";
+    out << hr->lru_cache->cold_lower_bound << "," << hr->lru_cache->evict_hot_for_cold << ",";
+    out << window_size << "," << hr->learning_rate << "," << hr->request_window->features_length << ",";
+    out << hr->request_window->features.at(FEAT_SIZE) << "," << hr->request_window->features.at(FEAT_FREQUENCY) << ",";
+    out << hr->objects_metadata->decay_factor << "," << hr->hazard_bandwidth << ",";
+    out << hr->hazard_discrete << "," << hr->future_labeling << ",";
+    out << hr->one_time_training << "," << hr->model->max_boost_round << "," << hr->report_interval << ",";
+    out << hr->analytics_round << "," << miss_bytes_percentage << "," << miss_percentage << ",";
+    out << cumulative_miss_bytes_percentage << "," << cumulative_miss_percentage << std::endl;
+}
+
 double get_current_memory_usage() {
     struct rusage usage;
     getrusage(RUSAGE_SELF, &usage);
@@ -170,23 +254,83 @@ void log_args(HRCache* hr) {
     std::cout << "Window size: " << window_size << std::endl;
     std::cout << "Learning rate: " << hr->learning_rate << std::endl;
     std::cout << "Features length: " << hr->request_window->features_length << std::endl;
+    std::cout << "Feature value: " << HR_FEATURE_VALUE_NAME << " (" << sizeof(HR_FeatureValue) << " bytes)" << std::endl;
     std::cout << "Size feature: " << hr->request_window->features.at(FEAT_SIZE) << std::endl;
     std::cout << "Frequency feature: " << hr->request_window->features.at(FEAT_FREQUENCY) << std::endl;
     std::cout << "Decayed frequency feature: " << hr->objects_metadata->decay_factor << std::endl;
     std::cout << "Hazard bandwidth: " << hr->hazard_bandwidth << std::endl;
     std::cout << "Hazard discrete: " << hr->hazard_discrete << std::endl;
+    std::cout << "Hazard max error: " << hr->hazard_max_error << std::endl;
     std::cout << "Future labeling: " << hr->future_labeling << std::endl;
     std::cout << "One time training: " << hr->one_time_training << std::endl;
+    std::cout << "Retrain mode: " << hr->retrain_mode << std::endl;
+    std::cout << "Predict mode: " << hr->predict_mode;
+    if (hr->predictor) {
+        std::cout << " (" << hr->predictor->latency_target * 1e6 << " us batches)";
+    }
+    std::cout << std::endl;
     std::cout << "Max boost rounds: " << hr->model->max_boost_round << std::endl;
+    std::cout << "Incremental boost rounds: " << hr->model->incremental_boost_round << std::endl;
+    std::cout << "Full rebuild interval: " << hr->model->full_rebuild_interval << std::endl;
+    std::cout << "Max TTL: " << hr->lru_cache->max_ttl << std::endl;
+    std::cout << "Hot max idle: " << hr->hot_max_idle << " (" << hr->demotion_steps << " demotion steps)" << std::endl;
+    std::cout << "Rescore budget: " << hr->rescore_budget << (hr->rescore_hot ? " (hot included)" : "") << std::endl;
     std::cout << "Report interval: " << hr->report_interval << std::endl;
     std::cout << "------------------------" << std::endl;
 }
 
+void record_evictions(HRCache* hr, const HR_LookupAdmitResult* result) {
+    if (result->hot_evictions_count > 0) {
+        hr->cumulative_hot_evicted_bytes += result->hot_evictions_bytes / 1e6;
+        hr->cumulative_hot_evicted_reqs += result->hot_evictions_count;
+        hr->analytics_hot_evicted_bytes += result->hot_evictions_bytes / 1e6;
+        hr->analytics_hot_evicted_reqs += result->hot_evictions_count;
+    }
+    if (result->cold_evictions_count > 0) {
+        hr->cumulative_cold_evicted_bytes += result->cold_evictions_bytes / 1e6;
+        hr->cumulative_cold_evicted_reqs += result->cold_evictions_count;
+        hr->analytics_cold_evicted_bytes += result->cold_evictions_bytes / 1e6;
+        hr->analytics_cold_evicted_reqs += result->cold_evictions_count;
+    }
+}
+
+// Admits the requests the predictor has scored so far, returns how many
+int apply_scored_requests(HRCache* hr) {
+    int count = 0;
+    HR_Request request;
+    while (predictor_next_scored(hr->predictor, &request)) {
+        uint64_t start = latency_ticks();
+        HR_LookupAdmitResult result = lookup_and_admit(hr->lru_cache, &request);
+        record_stage(hr->request_latencies, HR_STAGE_LOOKUP_ADMIT, start);
+        record_evictions(hr, &result);
+        schedule_expiry(hr->lru_cache, &request);
+        count++;
+    }
+    return count;
+}
+
+// Sums the stage histograms of every thread of the cache
+void merge_stage_latencies(HRCache* hr, HR_LatencySnapshot* snapshot) {
+    memset(snapshot, 0, sizeof(HR_LatencySnapshot));
+    merge_latencies(hr->request_latencies, snapshot);
+    merge_latencies(hr->training_latencies, snapshot);
+    if (hr->predictor) {
+        merge_latencies(hr->predictor->latencies, snapshot);
+    }
+}
+
 void log_analytics(HRCache* hr, bool last_log) {
+    // The process CPU time is read once per report, it covers every thread of the process
+    std::clock_t clock = std::clock();
+    double cpu_elapsed = 1e9 * static_cast<double>(clock - hr->reported_clock) / CLOCKS_PER_SEC;
+    hr->reported_clock = clock;
+    hr->analytics_cpu_times += cpu_elapsed;
+    if (hr->start_counting_cumulative) {
+        hr->cumulative_cpu_times += cpu_elapsed;
+    }
 
     if (hr->analytics_bytes != 0 && hr->analytics_reqs != 0) {
         hr->analytics_round++;
-        std::ofstream outfile("/Users/kjiyun/Desktop/HR-Cache/HR-Cache/hr_cache_result.txt");
         double miss_bytes_percentage = 100 - 100.0 * hr->analytics_bytes_hit / hr->analytics_bytes;
         double miss_percentage = 100 - 100.0 * hr->analytics_reqs_hit / hr->analytics_reqs;
         double avg_time = hr->analytics_times / hr->analytics_reqs;
@@ -201,55 +345,96 @@ void log_analytics(HRCache* hr, bool last_log) {
             cumulative_potential_reqs_per_sec = 1e9 / cumulative_avg_time;
         }
 
-        std::cout << std::setprecision(5);
-        std::cout << "Round: " << hr->analytics_round << std::endl;
-        std::cout << "Bytes miss: " << miss_bytes_percentage << "%" << std::endl;
-        std::cout << "Reqs miss: " << miss_percentage << "%" << std::endl;
-        std::cout << "Total bytes miss: " << cumulative_miss_bytes_percentage << "%" << std::endl;
-        std::cout << "Total reqs miss: " << cumulative_miss_percentage << "%" << std::endl;
-        std::cout << "Bytes: " << hr->analytics_bytes << std::endl;
-        std::cout << "Total bytes: " << hr->cumulative_bytes << std::endl;
-        std::cout << "Avg time: " << avg_time << " ns" << std::endl;
-        std::cout << "Avg CPU time: " << avg_cpu_time << " ns" << std::endl;
-        std::cout << "Total avg time: " << cumulative_avg_time << " ns" << std::endl;
-        std::cout << "Total avg CPU time: " << cumulative_avg_cpu_time << " ns" << std::endl;
-        std::cout << "reqs/s: " << static_cast<long long>(potential_reqs_per_sec) << std::endl;
-        std::cout << "Total reqs/s: " << static_cast<long long>(cumulative_potential_reqs_per_sec) << std::endl;
-        report_memory();
-        std::cout << "Hot evictions count percentage: " << 100.0 * hr->analytics_hot_evicted_reqs / (hr->analytics_hot_evicted_reqs + hr->analytics_cold_evicted_reqs) << "%" << std::endl;
-        std::cout << "Hot evictions bytes percentage: " << 100.0 * hr->analytics_hot_evicted_bytes / (hr->analytics_hot_evicted_bytes + hr->analytics_cold_evicted_bytes) << "%" << std::endl;
-        std::cout << "------------------------" << std::endl;
-
-        if (outfile.fail()) {
-            std::cerr << "Failed to open hr_cache_result.txt for writing." << std::endl;
-            return;
+        std::swap(hr->latencies_snapshot, hr->previous_latencies_snapshot);
+        merge_stage_latencies(hr, hr->latencies_snapshot);
+        if (hr->analytics_stream) {
+            write_analytics_row(
+                *hr->analytics_stream,
+                hr,
+                miss_bytes_percentage,
+                miss_percentage,
+                cumulative_miss_bytes_percentage,
+                cumulative_miss_percentage
+            );
         }
 
-        outfile << std::setprecision(5);
-        outfile << "MissRate: " << miss_percentage << std::endl;
-        outfile << "HitRate: " << (100.0 - miss_percentage) << std::endl;
-        outfile << "MemoryMB: " << get_current_memory_usage() << std::endl;
-        outfile << "ReqsPerSec: " << static_cast<long long>(potential_reqs_per_sec) << std::endl;
-        outfile.close();
-
-        if (hr->log_file) {
-            int window_size = hr->request_window->size ? *hr->request_window->size : 0;
-            hr->analytics_file << hr->key << "," << hr->lru_cache->capacity << "," << hr->lru_cache->hot_lower_bound << ",";
-            hr->analytics_file << hr->lru_cache->cold_lower_bound << "," << hr->lru_cache->evict_hot_for_cold << ",";
-            hr->analytics_file << window_size << "," << hr->learning_rate << "," << hr->request_window->features_length << ",";
-            hr->analytics_file << hr->request_window->features.at(FEAT_SIZE) << "," << hr->request_window->features.at(FEAT_FREQUENCY) << ",";
-            hr->analytics_file << hr->objects_metadata->decay_factor << "," << hr->hazard_bandwidth << ",";
-            hr->analytics_file << hr->hazard_discrete << "," << hr->future_labeling << ",";
-            hr->analytics_file << hr->one_time_training << "," << hr->model->max_boost_round << "," << hr->report_interval << ",";
-            hr->analytics_file << hr->analytics_round << "," << miss_bytes_percentage << "," << miss_percentage << ",";
-            hr->analytics_file << cumulative_miss_bytes_percentage << "," << cumulative_miss_percentage << std::endl;
+        if (hr->log_console) {
+            std::cout << std::setprecision(5);
+            std::cout << "Round: " << hr->analytics_round << std::endl;
+            std::cout << "Bytes miss: " << miss_bytes_percentage << "%" << std::endl;
+            std::cout << "Reqs miss: " << miss_percentage << "%" << std::endl;
+            std::cout << "Total bytes miss: " << cumulative_miss_bytes_percentage << "%" << std::endl;
+            std::cout << "Total reqs miss: " << cumulative_miss_percentage << "%" << std::endl;
+            std::cout << "Bytes: " << hr->analytics_bytes << std::endl;
+            std::cout << "Total bytes: " << hr->cumulative_bytes << std::endl;
+            std::cout << "Avg time: " << avg_time << " ns" << std::endl;
+            std::cout << "Avg CPU time: " << avg_cpu_time << " ns" << std::endl;
+            std::cout << "Total avg time: " << cumulative_avg_time << " ns" << std::endl;
+            std::cout << "Total avg CPU time: " << cumulative_avg_cpu_time << " ns" << std::endl;
+            std::cout << "reqs/s: " << static_cast<long long>(potential_reqs_per_sec) << std::endl;
+            std::cout << "Total reqs/s: " << static_cast<long long>(cumulative_potential_reqs_per_sec) << std::endl;
+            report_memory();
+            std::cout << "Metadata: " << hr->objects_metadata->objects_count() << " objects, ";
+            std::cout << hr->objects_metadata->memory() / 1e6 << " MB, " << hr->objects_metadata->evictions() << " evictions" << std::endl;
+            std::cout << "Hot evictions count percentage: " << 100.0 * hr->analytics_hot_evicted_reqs / (hr->analytics_hot_evicted_reqs + hr->analytics_cold_evicted_reqs) << "%" << std::endl;
+            std::cout << "Hot evictions bytes percentage: " << 100.0 * hr->analytics_hot_evicted_bytes / (hr->analytics_hot_evicted_bytes + hr->analytics_cold_evicted_bytes) << "%" << std::endl;
+            if (hr->lru_cache->expirations) {
+                std::cout << "Expired: " << hr->analytics_expired_bytes << " MB, " << hr->analytics_expired_reqs << " objects" << std::endl;
+            }
+            log_latencies(hr->latencies_snapshot, hr->previous_latencies_snapshot);
+            std::cout << "------------------------" << std::endl;
+
+            std::ofstream outfile("/Users/kjiyun/Desktop/HR-Cache/HR-Cache/hr_cache_result.txt");
+            if (outfile.fail()) {
+                std::cerr << "Failed to open hr_cache_result.txt for writing." << std::endl;
+                return;
+            }
+
+            outfile << std::setprecision(5);
+            outfile << "MissRate: " << miss_percentage << std::endl;
+            outfile << "HitRate: " << (100.0 - miss_percentage) << std::endl;
+            outfile << "MemoryMB: " << get_current_memory_usage() << std::endl;
+            outfile << "ReqsPerSec: " << static_cast<long long>(potential_reqs_per_sec) << std::endl;
+            outfile.close();
         }
     }
 
-    if (last_log) {
+    if (last_log && hr->predictor) {
+        predictor_flush(hr->predictor);
+        apply_scored_requests(hr);
+    }
+    // The last window may still be training in the background
+    if (last_log && hr->model_thread.joinable()) {
+        hr->model_thread.join();
+    }
+
+    if (last_log && hr->log_console) {
         std::cout << "Without training requests count: " << hr->without_training_count << std::endl;
+        std::cout << "Skipped windows: " << hr->skipped_windows << std::endl;
+        {
+            // training stats are written under model->mtx, and a shared model may be training for another shard
+            std::lock_guard<std::mutex> lock(hr->model->mtx);
+            std::cout << "Full trainings: " << hr->model->full_trainings << " (" << hr->model->full_training_seconds << " s)" << std::endl;
+            std::cout << "Incremental trainings: " << hr->model->incremental_trainings << " (" << hr->model->incremental_training_seconds << " s)" << std::endl;
+            std::cout << "Dataset construction: " << hr->model->dataset_seconds << " s, " << hr->model->reference_builds << " bin references" << std::endl;
+        }
         std::cout << "Hot evictions count percentage: " << 100.0 * hr->cumulative_hot_evicted_reqs / (hr->cumulative_hot_evicted_reqs + hr->cumulative_cold_evicted_reqs) << "%" << std::endl;
         std::cout << "Hot evictions bytes percentage: " << 100.0 * hr->cumulative_hot_evicted_bytes / (hr->cumulative_hot_evicted_bytes + hr->cumulative_cold_evicted_bytes) << "%" << std::endl;
+        if (hr->lru_cache->expirations) {
+            double removed_bytes = hr->cumulative_expired_bytes + hr->cumulative_hot_evicted_bytes + hr->cumulative_cold_evicted_bytes;
+            std::cout << "Expired: " << hr->cumulative_expired_bytes << " MB, " << hr->cumulative_expired_reqs << " objects, ";
+            std::cout << 100.0 * hr->cumulative_expired_bytes / removed_bytes << "% of removed bytes" << std::endl;
+        }
+        std::cout << "Stale hot demotions: " << hr->cumulative_demoted_reqs << std::endl;
+        if (hr->predictor) {
+            log_predictor_stats(hr->predictor);
+        }
+        merge_stage_latencies(hr, hr->latencies_snapshot);
+        log_latencies(hr->latencies_snapshot, NULL);
+        if (hr->rescore_budget > 0) {
+            std::cout << "Rescored: " << hr->cumulative_rescored_reqs << ", evicted " << hr->cumulative_rescore_evicted_reqs;
+            std::cout << " (" << hr->cumulative_rescore_evicted_bytes << " MB), demoted " << hr->cumulative_rescore_demoted_reqs << std::endl;
+        }
         std::cout << "------------------------" << std::endl;
     }
 }
@@ -303,48 +488,61 @@ void update_analytics(HRCache* hr, bool cache_hit, int size, bool predicted) {
         hr->analytics_hot_evicted_reqs = 0;
         hr->analytics_cold_evicted_bytes = 0;
         hr->analytics_cold_evicted_reqs = 0;
+        hr->analytics_expired_bytes = 0;
+        hr->analytics_expired_reqs = 0;
     }
 }
 
 void sync_requests(HRCache* hr) {
-    if (hr->request_window->requests_count <= 1) {
+    HR_RequestWindow* request_window = hr->request_window;
+    if (request_window->requests_count <= 1) {
         return;
     }
 
-    if (hr->last_processed_request == hr->request_window->request->prev_in_time) {
+    // The unsynced requests are the tail of the window, so their features are already contiguous
+    int first_request = hr->last_processed_request + 1;
+    if (first_request >= request_window->requests_count) {
         return;
     }
+    int requests_count = request_window->requests_count - first_request;
+    hr->last_processed_request = request_window->requests_count - 1;
 
-    if (!hr->last_processed_request) {
-        hr->last_processed_request = hr->request_window->request;
-    } else {
-        hr->last_processed_request = hr->last_processed_request->next_in_time;
+    if (hr->model->available) {
+        uint64_t start = latency_ticks();
+        predict_requests(
+            hr->model,
+            get_request_features(request_window, first_request),
+            requests_count,
+            request_window->admit_probabilities + first_request
+        );
+        record_stage(hr->request_latencies, HR_STAGE_PREDICT, start);
     }
 
-    HR_Request** requests = new HR_Request*[hr->concurrency];
-    int requests_count = 0;
-    while (true) {
-        requests[requests_count++] = hr->last_processed_request;
-
-        if (hr->last_processed_request->next_in_time == hr->request_window->request) {
-            break;
+    for (int i = first_request; i < request_window->requests_count; i++) {
+        HR_Request request = get_request(request_window, i);
+        uint64_t start = latency_ticks();
+        lookup_and_admit(hr->lru_cache, &request);
+        record_stage(hr->request_latencies, HR_STAGE_LOOKUP_ADMIT, start);
+        if (hr->model->available) {
+            schedule_expiry(hr->lru_cache, &request);
         }
-        hr->last_processed_request = hr->last_processed_request->next_in_time;
-    }
-
-    if (hr->model->available) {
-        predict_requests(hr->model, requests, requests_count);
     }
+}
 
-    for (int i = 0; i < requests_count; i++) {
-        lookup_and_admit(hr->lru_cache, requests[i]);
+void rescore_cache(HRCache* hr) {
+    if (hr->model->available && hr->rescore_budget > 0) {
+        HR_CleanupResult result = cleanup_cache(hr->lru_cache, hr->model, hr->objects_metadata, hr->rescore_budget, hr->rescore_hot);
+        hr->cumulative_rescored_reqs += result.rescored_count;
+        hr->cumulative_rescore_evicted_reqs += result.evictions_count;
+        hr->cumulative_rescore_evicted_bytes += result.evictions_bytes / 1e6;
+        hr->cumulative_rescore_demoted_reqs += result.demotions_count;
     }
-
-    delete[] requests;
 }
 
-void update_model(HRCache* hr, bool wait_for_model) {
-    if (hr->model_thread.joinable()) {
+void update_model(HRCache* hr) {
+    // The previous window may still be training in the background
+    bool skip = hr->retrain_mode == RETRAIN_SKIP && hr->training;
+    if (!skip && hr->model_thread.joinable()) {
         hr->model_thread.join();
     }
     
@@ -359,92 +557,129 @@ void update_model(HRCache* hr, bool wait_for_model) {
         old_request_window->objects_metadata
     );
 
+    if (skip) {
+        hr->skipped_windows++;
+        destroy_request_window(old_request_window);
+        return;
+    }
+
+    hr->training = true;
     hr->model_thread = std::thread([hr, old_request_window]() {
-        if ((hr->model->row_count == 0 && !hr->model->full) || !hr->one_time_training) {
+        bool untrained;
+        {
+            // the model may be shared with other shards that are training it right now
+            std::lock_guard<std::mutex> lock(hr->model->mtx);
+            untrained = hr->model->row_count == 0 && !hr->model->full;
+        }
+
+        if (untrained || !hr->one_time_training) {
             prepare_request_window(
                 old_request_window,
                 hr->model->max_train_set_count / 2,
                 hr->hazard_bandwidth,
                 hr->hazard_discrete,
+                hr->hazard_max_error,
                 hr->future_labeling,
-                hr->verbose
+                hr->labeling_threads,
+                hr->verbose,
+                hr->training_latencies
             );
+            uint64_t start = latency_ticks();
             update_hr_model(
                 hr->model,
+                old_request_window->request_features,
+                old_request_window->labels,
                 old_request_window->sampled_requests,
                 old_request_window->sampled_requests_count,
                 hr->verbose
             );
+            record_stage(hr->training_latencies, HR_STAGE_TRAIN, start);
         }
 
-        // TODO: takes too much time on huge windows
         destroy_request_window(old_request_window);
+        hr->training = false;
     });
 
-    if (wait_for_model) {
+    if (hr->retrain_mode == RETRAIN_SYNC) {
         hr->model_thread.join();
     }
 }
 
 bool new_request(HRCache* hr, double timestamp, int object_id, int size) {
-    std::cout << "[DEBUG] new_request 호출, objects_metadata 포인터: " 
-          << hr->objects_metadata << std::endl;
-    std::clock_t cpu_start = std::clock();
-    auto start = std::chrono::high_resolution_clock::now();
-
-    HR_Request* request = add_request(hr->request_window, object_id, timestamp, size);
-    HR_LookupAdmitResult result = lookup_and_admit(hr->lru_cache, request);
-    update_analytics(hr, result.hit, size, hr->model->available);
-
-    if (result.hot_evictions_count > 0) {
-        hr->cumulative_hot_evicted_bytes += result.hot_evictions_bytes / 1e6;
-        hr->cumulative_hot_evicted_reqs += result.hot_evictions_count;
-        hr->analytics_hot_evicted_bytes += result.hot_evictions_bytes / 1e6;
-        hr->analytics_hot_evicted_reqs += result.hot_evictions_count;
-    }
-    if (result.cold_evictions_count > 0) {
-        hr->cumulative_cold_evicted_bytes += result.cold_evictions_bytes / 1e6;
-        hr->cumulative_cold_evicted_reqs += result.cold_evictions_count;
-        hr->analytics_cold_evicted_bytes += result.cold_evictions_bytes / 1e6;
-        hr->analytics_cold_evicted_reqs += result.cold_evictions_count;
+    uint64_t start = latency_ticks();
+
+    long long expired_bytes = 0;
+    int expired_count = expire_cache(hr->lru_cache, timestamp, &expired_bytes);
+    if (expired_count > 0) {
+        hr->cumulative_expired_bytes += expired_bytes / 1e6;
+        hr->cumulative_expired_reqs += expired_count;
+        hr->analytics_expired_bytes += expired_bytes / 1e6;
+        hr->analytics_expired_reqs += expired_count;
+    }
+
+    HR_RequestWindow* request_window = hr->request_window;
+    uint64_t stage_start = latency_ticks();
+    int request_index = add_request(request_window, object_id, timestamp, size);
+    stage_start = record_stage(hr->request_latencies, HR_STAGE_ADD_REQUEST, stage_start);
+    HR_Request request = get_request(request_window, request_index);
+    bool predicted = hr->model->available;
+    bool hit;
+    bool admitted = false;
+    if (hr->predictor && predicted) {
+        // the cache is only touched once the request is scored, the hit is decided now
+        apply_scored_requests(hr);
+        hit = lookup_without_move(hr->lru_cache, object_id) != NULL;
+        while (!predictor_submit(hr->predictor, &request, get_request_features(request_window, request_index))) {
+            if (apply_scored_requests(hr) == 0) {
+                std::this_thread::yield();
+            }
+        }
+    } else {
+        HR_LookupAdmitResult result = lookup_and_admit(hr->lru_cache, &request);
+        record_stage(hr->request_latencies, HR_STAGE_LOOKUP_ADMIT, stage_start);
+        record_evictions(hr, &result);
+        hit = result.hit;
+        admitted = result.admitted;
+    }
+    update_analytics(hr, hit, size, predicted);
+
+    if (hr->hot_max_idle > 0) {
+        hr->cumulative_demoted_reqs += demote_stale_hot(hr->lru_cache, timestamp - hr->hot_max_idle, hr->demotion_steps);
     }
     
     if (window_is_ready(hr->request_window, 1 / hr->learning_rate)) {
-        // cleanup_expired_hot(hr->lru_cache, timestamp - (12 * 60 * 60));
-        sync_requests(hr);
-        hr->last_processed_request = NULL;
-        update_model(hr, true);
+        if (hr->predict_mode == PREDICT_SYNC) {
+            sync_requests(hr);
+        }
+        hr->last_processed_request = -1;
+        update_model(hr);
     }
 
     if (hr->request_window->requests_count % hr->concurrency == 0) {
-        sync_requests(hr);
+        if (hr->predict_mode == PREDICT_SYNC) {
+            sync_requests(hr);
+        }
+        rescore_cache(hr);
     }
 
-    auto end = std::chrono::high_resolution_clock::now();
-    std::chrono::duration<double, std::nano> elapsed = end - start;
-    hr->analytics_times += elapsed.count();
-    std::clock_t cpu_end = std::clock();
-    double cpu_time_in_seconds = static_cast<double>(cpu_end - cpu_start) / CLOCKS_PER_SEC;
-    double cpu_elapsed = 1e9 * cpu_time_in_seconds;
-    hr->analytics_cpu_times += cpu_elapsed;
+    double elapsed = ticks_to_nanoseconds(record_stage(hr->request_latencies, HR_STAGE_REQUEST, start) - start);
+    hr->analytics_times += elapsed;
+    hr->cumulative_times += elapsed;
 
-    // if (hr->model->available) {
-    if (true) {
-        double prob = request->admit_probability;
-        double base_ttl = 60.0;
-        double ttl_seconds = 1.0 * prob; 
-        hr->cumulative_cpu_times += cpu_elapsed;
-        hr->cumulative_times += elapsed.count();
-        hr->objects_metadata->set_ttl_for_object(object_id, ttl_seconds);
-    }
-
-    return result.admitted;
+    return admitted;
 }
 
 void destroy_hr(HRCache* hr) {
     if (hr->model_thread.joinable()) {
         hr->model_thread.join();
     }
+    if (hr->predictor) {
+        destroy_predictor(hr->predictor);
+    }
+    destroy_latency_histograms(hr->request_latencies);
+    destroy_latency_histograms(hr->training_latencies);
+    delete hr->latencies_snapshot;
+    delete hr->previous_latencies_snapshot;
 
     if (hr->lru_cache) {
         destroy_lru_cache(hr->lru_cache);
@@ -452,7 +687,7 @@ void destroy_hr(HRCache* hr) {
     if (hr->request_window) {
         destroy_request_window(hr->request_window);
     }
-    if (hr->model) {
+    if (hr->model && hr->owns_model) {
         destroy_hr_model(hr->model);
     }
     if (hr->objects_metadata) {
@@ -0,0 +1,110 @@
+#include "latency.h"
+#include <string.h>
+#include <iostream>
+#include <thread>
+
+const char* STAGE_NAMES[HR_STAGES_COUNT] = {
+    "request",
+    "add_request",
+    "lookup_and_admit",
+    "predict",
+    "sample_objects",
+    "prepare_objects",
+    "prepare_requests",
+    "train"
+};
+const double PERCENTILES[] = {0.5, 0.9, 0.99, 0.999};
+
+HR_LatencyHistograms* create_latency_histograms() {
+    HR_LatencyHistograms* latencies = new HR_LatencyHistograms;
+    for (int stage = 0; stage < HR_STAGES_COUNT; stage++) {
+        for (int bucket = 0; bucket < HR_HISTOGRAM_BUCKETS; bucket++) {
+            latencies->stages[stage].counts[bucket].store(0, std::memory_order_relaxed);
+        }
+    }
+    return latencies;
+}
+
+// Measured once against the steady clock over a few milliseconds
+double latency_ticks_per_nanosecond() {
+    static double ticks_per_nanosecond = []() {
+        auto start = std::chrono::steady_clock::now();
+        uint64_t start_ticks = latency_ticks();
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        uint64_t end_ticks = latency_ticks();
+        std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+        return (end_ticks - start_ticks) / elapsed.count();
+    }();
+    return ticks_per_nanosecond;
+}
+
+double ticks_to_nanoseconds(uint64_t ticks) {
+    return ticks / latency_ticks_per_nanosecond();
+}
+
+void merge_latencies(const HR_LatencyHistograms* latencies, HR_LatencySnapshot* snapshot) {
+    for (int stage = 0; stage < HR_STAGES_COUNT; stage++) {
+        for (int bucket = 0; bucket < HR_HISTOGRAM_BUCKETS; bucket++) {
+            snapshot->counts[stage][bucket] += latencies->stages[stage].counts[bucket].load(std::memory_order_relaxed);
+        }
+    }
+}
+
+// The largest value counted in the bucket
+static uint64_t bucket_high(int bucket) {
+    if (bucket < HR_HISTOGRAM_SUB_BUCKETS) {
+        return bucket;
+    }
+    int shift = bucket / HR_HISTOGRAM_SUB_BUCKETS - 1;
+    uint64_t low = static_cast<uint64_t>(bucket % HR_HISTOGRAM_SUB_BUCKETS + HR_HISTOGRAM_SUB_BUCKETS) << shift;
+    return low + (1ULL << shift) - 1;
+}
+
+uint64_t histogram_percentile(const uint64_t* counts, double fraction) {
+    uint64_t total = 0;
+    for (int bucket = 0; bucket < HR_HISTOGRAM_BUCKETS; bucket++) {
+        total += counts[bucket];
+    }
+    uint64_t rank = static_cast<uint64_t>(fraction * total);
+    uint64_t seen = 0;
+    for (int bucket = 0; bucket < HR_HISTOGRAM_BUCKETS; bucket++) {
+        seen += counts[bucket];
+        if (seen > rank) {
+            return bucket_high(bucket);
+        }
+    }
+    return bucket_high(HR_HISTOGRAM_BUCKETS - 1);
+}
+
+void log_latencies(const HR_LatencySnapshot* current, const HR_LatencySnapshot* previous) {
+    std::cout << "Latencies (p50 / p90 / p99 / p99.9):" << std::endl;
+    uint64_t counts[HR_HISTOGRAM_BUCKETS];
+    for (int stage = 0; stage < HR_STAGES_COUNT; stage++) {
+        uint64_t samples = 0;
+        for (int bucket = 0; bucket < HR_HISTOGRAM_BUCKETS; bucket++) {
+            counts[bucket] = current->counts[stage][bucket] - (previous ? previous->counts[stage][bucket] : 0);
+            samples += counts[bucket];
+        }
+        if (samples == 0) {
+            continue;
+        }
+
+        std::cout << "  " << STAGE_NAMES[stage] << ": ";
+        for (int i = 0; i < 4; i++) {
+            double nanoseconds = ticks_to_nanoseconds(histogram_percentile(counts, PERCENTILES[i]));
+            if (nanoseconds >= 1e6) {
+                std::cout << nanoseconds / 1e6 << " ms";
+            } else if (nanoseconds >= 1e3) {
+                std::cout << nanoseconds / 1e3 << " us";
+            } else {
+                std::cout << static_cast<long long>(nanoseconds) << " ns";
+            }
+            std::cout << (i < 3 ? " / " : "");
+        }
+        std::cout << " (" << samples << " samples)" << std::endl;
+    }
+}
+
+void destroy_latency_histograms(HR_LatencyHistograms* latencies) {
+    delete latencies;
+}
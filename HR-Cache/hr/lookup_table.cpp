@@ -0,0 +1,114 @@
+#include "lookup_table.h"
+#include <stdlib.h>
+
+const int MIN_SLOTS_COUNT = 1024;
+
+// Grow above 1/2 load and shrink below 1/8, so a miss scans a couple of slots on average
+// and memory follows the number of live entries rather than the number ever inserted.
+const int MAX_LOAD_SHIFT = 1;
+const int MIN_LOAD_SHIFT = 3;
+
+void allocate_slots(HR_LookupTable* table, uint32_t slots_count) {
+    table->slots = static_cast<HR_LookupTableSlot*>(malloc(sizeof(HR_LookupTableSlot) * slots_count));
+    for (uint32_t i = 0; i < slots_count; i++) {
+        table->slots[i].value = HR_LOOKUP_TABLE_EMPTY;
+    }
+    table->mask = slots_count - 1;
+    table->shift = 32;
+    while (slots_count > 1) {
+        slots_count >>= 1;
+        table->shift--;
+    }
+}
+
+HR_LookupTable* create_lookup_table(int expected_count) {
+    uint32_t slots_count = MIN_SLOTS_COUNT;
+    while (slots_count < (static_cast<uint32_t>(expected_count) << MAX_LOAD_SHIFT)) {
+        slots_count <<= 1;
+    }
+
+    HR_LookupTable* table = new HR_LookupTable;
+    table->count = 0;
+    table->min_slots_count = slots_count;
+    allocate_slots(table, slots_count);
+    return table;
+}
+
+void place(HR_LookupTable* table, int key, int32_t value) {
+    uint32_t i = lookup_table_home(table, key);
+    while (table->slots[i].value != HR_LOOKUP_TABLE_EMPTY && table->slots[i].key != key) {
+        i = (i + 1) & table->mask;
+    }
+    if (table->slots[i].value == HR_LOOKUP_TABLE_EMPTY) {
+        table->count++;
+    }
+    table->slots[i].key = key;
+    table->slots[i].value = value;
+}
+
+void resize(HR_LookupTable* table, uint32_t slots_count) {
+    HR_LookupTableSlot* old_slots = table->slots;
+    uint32_t old_slots_count = table->mask + 1;
+
+    allocate_slots(table, slots_count);
+    table->count = 0;
+    for (uint32_t i = 0; i < old_slots_count; i++) {
+        if (old_slots[i].value != HR_LOOKUP_TABLE_EMPTY) {
+            place(table, old_slots[i].key, old_slots[i].value);
+        }
+    }
+    free(old_slots);
+}
+
+void lookup_table_insert(HR_LookupTable* table, int key, int32_t value) {
+    if ((static_cast<uint32_t>(table->count + 1) << MAX_LOAD_SHIFT) > table->mask + 1) {
+        resize(table, (table->mask + 1) << 1);
+    }
+    place(table, key, value);
+}
+
+bool lookup_table_erase(HR_LookupTable* table, int key) {
+    uint32_t i = lookup_table_home(table, key);
+    while (table->slots[i].key != key || table->slots[i].value == HR_LOOKUP_TABLE_EMPTY) {
+        if (table->slots[i].value == HR_LOOKUP_TABLE_EMPTY) {
+            return false;
+        }
+        i = (i + 1) & table->mask;
+    }
+
+    // Shift the following entries of the cluster back into the hole,
+    // unless that would move an entry in front of its home slot
+    uint32_t j = i;
+    while (true) {
+        j = (j + 1) & table->mask;
+        if (table->slots[j].value == HR_LOOKUP_TABLE_EMPTY) {
+            break;
+        }
+
+        uint32_t home = lookup_table_home(table, table->slots[j].key);
+        if (((j - home) & table->mask) >= ((j - i) & table->mask)) {
+            table->slots[i] = table->slots[j];
+            i = j;
+        }
+    }
+    table->slots[i].value = HR_LOOKUP_TABLE_EMPTY;
+    table->count--;
+
+    uint32_t slots_count = table->mask + 1;
+    if (
+        slots_count > static_cast<uint32_t>(table->min_slots_count) &&
+        (static_cast<uint32_t>(table->count) << MIN_LOAD_SHIFT) < slots_count
+    ) {
+        resize(table, slots_count >> 1);
+    }
+    return true;
+}
+
+long long lookup_table_memory(const HR_LookupTable* table) {
+    return sizeof(HR_LookupTable) + sizeof(HR_LookupTableSlot) * (static_cast<long long>(table->mask) + 1);
+}
+
+void destroy_lookup_table(HR_LookupTable* table) {
+    free(table->slots);
+    delete table;
+}
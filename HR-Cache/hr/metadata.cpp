@@ -1,175 +1,156 @@
 // metadata.cpp
 
 #include "metadata.h"
-#include <cmath>
-#include <ctime>
-#include <iostream>
 #include <algorithm>
-#include <mutex>
-#include <unordered_map>
+#include <cstring>
+#include <stdlib.h>
 
-std::unordered_map<int, double> g_insert_time_map;
+const int MINIMUM_SLOTS_CAPACITY = 1024;
 
-// 기존 생성자/소멸자 구현
 HR_ObjectsMetadata::HR_ObjectsMetadata(int capacity, int features_length, double decay_factor)
-    : max_objects_(capacity),
-        features_length(features_length),
-        decay_factor(decay_factor) 
+    : decay_factor(decay_factor),
+        max_objects_(capacity),
+        features_length(features_length)
 {
-        this->features_length = features_length;
-        this->decay_factor = decay_factor;
-        int object_meta_size = sizeof(HR_ObjectMetadata) + sizeof(double) * features_length + sizeof(HR_ObjectLastSeen);
+        int object_meta_size = sizeof(int) + sizeof(double) + sizeof(HR_FeatureValue) * features_length + sizeof(uint8_t)
+            + 2 * sizeof(HR_LookupTableSlot);
         this->max_objects_count = MINIMUM_OBJECTS_COUNT + capacity / object_meta_size;
         this->decayed_frequency = 0;
+
+        slots_table = create_lookup_table(0);
+        slots_count = 0;
+        slots_capacity = 0;
+        object_ids = NULL;
+        decayed_frequencies = NULL;
+        features = NULL;
+        slot_flags = NULL;
+        clock_hand = 0;
+        evictions_count = 0;
 }
 
 HR_ObjectsMetadata::~HR_ObjectsMetadata() {
+    destroy_lookup_table(slots_table);
+    free(object_ids);
+    free(decayed_frequencies);
+    free(features);
+    free(slot_flags);
+}
 
-    for (auto const& [object_id, object_metadata] : objects) {
-            // delete[] object_metadata->features;
-            // delete object_metadata->last_seen;
-            delete object_metadata;
-        }
-    objects.clear();
+template <typename T>
+static void grow_column(T*& column, long long capacity) {
+    column = static_cast<T*>(realloc(column, sizeof(T) * capacity));
 }
 
-HR_ObjectMetadata* HR_ObjectsMetadata::get_metadata(int object_id, int timestamp) {
-    auto it = objects.find(object_id);
-    if (it == objects.end()) {
-        HR_ObjectMetadata* object_metadata = new HR_ObjectMetadata;
-        object_metadata->decayed_frequency = 0;
+void HR_ObjectsMetadata::grow_slots() {
+    // the columns never grow past the budget
+    slots_capacity = std::min(std::max(2 * slots_capacity, MINIMUM_SLOTS_CAPACITY), max_objects_count);
+    grow_column(object_ids, slots_capacity);
+    grow_column(decayed_frequencies, slots_capacity);
+    grow_column(features, static_cast<long long>(slots_capacity) * features_length);
+    grow_column(slot_flags, slots_capacity);
+}
 
-        // features 배열 할당하고, INF로 초기화
-        object_metadata->features = new double[features_length];
-        std::fill(
-            object_metadata->features,
-            object_metadata->features + features_length,
-            INF
-        );
+// Sweeps the CLOCK hand over the slots, clearing reference bits, until it reaches a slot whose object
+// was not seen since the previous sweep, and frees that object's slot
+int HR_ObjectsMetadata::evict_slot() {
+    while (true) {
+        int slot = clock_hand;
+        clock_hand = clock_hand + 1 == slots_count ? 0 : clock_hand + 1;
+        if (!(slot_flags[slot] & HR_METADATA_SLOT_USED)) {
+            continue;
+        }
+        if (slot_flags[slot] & HR_METADATA_SLOT_REFERENCED) {
+            slot_flags[slot] &= ~HR_METADATA_SLOT_REFERENCED;
+            continue;
+        }
 
-        // last_seen 구조체 할당하고 필드 설정
-        object_metadata->last_seen = new HR_ObjectLastSeen{ object_id, (double)timestamp };
+        lookup_table_erase(slots_table, object_ids[slot]);
+        slot_flags[slot] = 0;
+        evictions_count++;
+        return slot;
+    }
+}
 
-        // 맵과 set에 삽입
-        objects[object_id] = object_metadata;
-        //objects_last_seen.insert(object_metadata->last_seen);
+// The slot of the object, taken and initialized on its first request
+int HR_ObjectsMetadata::get_slot(int object_id) {
+    int32_t slot = lookup_table_find(slots_table, object_id);
+    if (slot != HR_LOOKUP_TABLE_EMPTY) {
+        return slot;
+    }
 
-        return object_metadata;
+    if (slots_table->count >= max_objects_count) {
+        slot = evict_slot();
+    } else if (!free_slots.empty()) {
+        slot = free_slots.back();
+        free_slots.pop_back();
+    } else {
+        if (slots_count == slots_capacity) {
+            grow_slots();
+        }
+        slot = slots_count++;
     }
-    return it->second;
+    lookup_table_insert(slots_table, object_id, slot);
+
+    object_ids[slot] = object_id;
+    decayed_frequencies[slot] = 0;
+    slot_flags[slot] = HR_METADATA_SLOT_USED;
+    // objects without history have every interval at INF
+    HR_FeatureValue* object_features = features + static_cast<long long>(slot) * features_length;
+    std::fill(object_features, object_features + features_length, encode_feature(INF));
+    return slot;
 }
 
-void HR_ObjectsMetadata::update_features(int object_id, double* features) {
-    auto it = objects.find(object_id);
-    if (it == objects.end()) return;
+void HR_ObjectsMetadata::update_features(int object_id, const HR_FeatureValue* features) {
+    int32_t slot = lookup_table_find(slots_table, object_id);
+    if (slot == HR_LOOKUP_TABLE_EMPTY) return;
 
-    HR_ObjectMetadata* object_metadata = it->second;
     std::memcpy(
-        object_metadata->features,
+        this->features + static_cast<long long>(slot) * features_length,
         features,
-        sizeof(double) * features_length
+        sizeof(HR_FeatureValue) * features_length
     );
 }
 
-double* HR_ObjectsMetadata::get_features(int object_id) {
-    auto it = objects.find(object_id);
-    if (it == objects.end()) return nullptr;
-    return it->second->features;
+HR_FeatureValue* HR_ObjectsMetadata::get_features(int object_id) {
+    int32_t slot = lookup_table_find(slots_table, object_id);
+    if (slot == HR_LOOKUP_TABLE_EMPTY) return nullptr;
+    return features + static_cast<long long>(slot) * features_length;
 }
 
 double HR_ObjectsMetadata::get_decayed_frequency(int object_id) {
-    auto it = objects.find(object_id);
-    if (it == objects.end()) return 0.0;
-    return it->second->decayed_frequency / decayed_frequency;
+    int32_t slot = lookup_table_find(slots_table, object_id);
+    if (slot == HR_LOOKUP_TABLE_EMPTY) return 0.0;
+    return decayed_frequencies[slot] / decayed_frequency;
 }
 
-void HR_ObjectsMetadata::seen(int object_id, double timestamp) {
-    HR_ObjectMetadata* object_metadata = get_metadata(object_id, timestamp);
+void HR_ObjectsMetadata::seen(int object_id) {
+    int slot = get_slot(object_id);
 
     // 전체 decayed_frequency, 개별 decayed_frequency 갱신
     decayed_frequency = decayed_frequency * decay_factor + 1;
-    object_metadata->decayed_frequency = object_metadata->decayed_frequency * decay_factor + 1;
+    decayed_frequencies[slot] = decayed_frequencies[slot] * decay_factor + 1;
+    slot_flags[slot] |= HR_METADATA_SLOT_REFERENCED;
 }
 
-void HR_ObjectsMetadata::set_ttl_for_object(int object_id, double unused_ttl) {
-    // 1) 현재 시각 얻기
-    double now_ts = static_cast<double>(time(nullptr));
-
-    // 2) 해저드율 예측
-    double lambda = predict_hazard_rate(object_id, now_ts);
-    //    λ(t)가 0이 되면 안 되므로, 최소값 보장
-    if (lambda <= 0.0) {
-        lambda = 0.01; 
-    }
-
-    // 3) TTL 계산
-    //    보통 해저드율 λ(t)를 “단위시간당 재요청 확률”로 본다면,
-    //    기대 재요청 간격(평균 시간) ≈ 1 / λ(t)
-    //    → 이 값을 TTL로 사용
-    double ttl_seconds = 1.0 / lambda;
-
-    {
-        // 4) 뮤텍스를 잡고 맵 갱신
-        std::lock_guard<std::mutex> guard(ttl_mutex_);
-        object_ttl_map_[object_id] = ttl_seconds;
+void HR_ObjectsMetadata::remove(int object_id) {
+    int32_t slot = lookup_table_find(slots_table, object_id);
+    if (slot == HR_LOOKUP_TABLE_EMPTY) return;
 
-        // 전역 삽입 시간 맵 업데이트
-        extern std::unordered_map<int, double> g_insert_time_map;
-        g_insert_time_map[object_id] = now_ts;
-    }
-
-    // debug 로그
-    std::cout << "[Metadata] object " << object_id 
-              << " predicted λ=" << lambda 
-              << ", set TTL=" << ttl_seconds << "s\n";
+    lookup_table_erase(slots_table, object_id);
+    slot_flags[slot] = 0;
+    free_slots.push_back(slot);
 }
 
-double HR_ObjectsMetadata::get_ttl_for_object(int object_id) const {
-    std::lock_guard<std::mutex> lock(ttl_mutex_);
-    auto it = object_ttl_map_.find(object_id);
-    if (it == object_ttl_map_.end()) {
-        return 0.0;
-    }
-    return it->second;
+int HR_ObjectsMetadata::objects_count() const {
+    return slots_table->count;
 }
 
-bool HR_ObjectsMetadata::is_expired(int object_id, double now_timestamp) const {
-    std::lock_guard<std::mutex> lock(ttl_mutex_);
-
-    auto it_ttl = object_ttl_map_.find(object_id);
-    if (it_ttl == object_ttl_map_.end()) {
-        // TTL 정보가 없으면, “만료되지 않음”으로 간주
-        return false;
-    }
-    double ttl_seconds = it_ttl->second;
-
-    // 삽입 시각을 기록한 데이터가 있어야 비교 가능하지만,
-    // 여기서는 예시로 ‘insert_time’ 맵이 있다고 가정합니다.
-    // 만약 HR_ObjectsMetadata 내부에 insert_time_map_가 없다면, 
-    // 삽입 시각을 저장하는 로직을 별도로 추가해야 합니다.
-
-    extern std::unordered_map<int, double> g_insert_time_map;
-    auto it_insert = g_insert_time_map.find(object_id);
-    if (it_insert == g_insert_time_map.end()) {
-        return false;
-    }
-
-    double insert_time = it_insert->second;
-    return (now_timestamp >= insert_time + ttl_seconds);
+long long HR_ObjectsMetadata::memory() const {
+    long long slot_size = sizeof(int) + sizeof(double) + sizeof(HR_FeatureValue) * features_length + sizeof(uint8_t);
+    return static_cast<long long>(slots_capacity) * slot_size + lookup_table_memory(slots_table)
+        + static_cast<long long>(free_slots.capacity()) * sizeof(int);
 }
 
-double HR_ObjectsMetadata::predict_hazard_rate(int object_id, double now_timestamp) const {
-    
-    // 처음 들어온 객체인 경우 기본 5초 ttl
-    if (object_ttl_map_.count(object_id) == 0) {
-        return 5.0;
-    }
-
-    // 이미 존재한다면 이전 ttl의 80% 만큼 줄여서 반환
-    double prev_ttl = object_ttl_map_.at(object_id);
-    double new_ttl = prev_ttl * 0.8;
-    if (new_ttl < 1.0) {
-        new_ttl = 1.0;  // TTL이 너무 작아지면 최소 1초는 보장
-    }
-    return new_ttl;
-}
\ No newline at end of file
+long long HR_ObjectsMetadata::evictions() const {
+    return evictions_count;
+}
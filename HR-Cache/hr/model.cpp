@@ -8,113 +8,311 @@
 #include <algorithm>
 #include <random>
 #include <vector>
+#include <string>
+#include <chrono>
+#include <cmath>
 
 const int MIN_DATA_SET_COUNT = 100 * 1000;
 const int MAX_DATA_SET_COUNT = 1000 * 1000;
 
-HR_Model* create_hr_model(int capacity, int features_length, int max_boost_round) {
+const int DRIFT_BINS = 10;
+const int DRIFT_SAMPLE_COUNT = 16 * 1024;
+const int REFERENCE_SAMPLE_COUNT = 200 * 1000;  // LightGBM's default bin_construct_sample_cnt
+const double DRIFT_THRESHOLD = 0.2;
+const double DRIFT_MINIMUM_PROPORTION = 1e-4;
+
+HR_Model* create_hr_model(int capacity, int features_length, int max_boost_round, int incremental_boost_round, int full_rebuild_interval) {
     HR_Model* hr_model = new HR_Model;
     hr_model->row_count = 0;
     hr_model->full = false;
     hr_model->available = false;
+    hr_model->snapshot = NULL;
+    hr_model->epoch = 0;
+    hr_model->readers[0].count = 0;
+    hr_model->readers[1].count = 0;
     hr_model->max_boost_round = max_boost_round;
+    hr_model->incremental_boost_round = incremental_boost_round;
+    hr_model->full_rebuild_interval = full_rebuild_interval;
+    hr_model->trainings_since_rebuild = 0;
+    hr_model->full_trainings = 0;
+    hr_model->incremental_trainings = 0;
+    hr_model->full_training_seconds = 0;
+    hr_model->incremental_training_seconds = 0;
+    hr_model->threads = 0;
     int metadata_size = (features_length + 1) * sizeof(double);
     hr_model->max_train_set_count = std::min(capacity / metadata_size, MAX_DATA_SET_COUNT);
     hr_model->max_train_set_count = std::max(hr_model->max_train_set_count, MIN_DATA_SET_COUNT);
-    hr_model->data = new double*[hr_model->max_train_set_count];
-    for (int i = 0; i < hr_model->max_train_set_count; i++) {
-        hr_model->data[i] = new double[features_length + 1];
-    }
+    hr_model->features = new HR_TrainingValue[static_cast<long long>(hr_model->max_train_set_count) * features_length];
+    hr_model->labels = new float[hr_model->max_train_set_count];
+    hr_model->random.seed(std::random_device{}());
     hr_model->features_length = features_length;
+    hr_model->reference_dataset = NULL;
+    hr_model->drift_edges = new double[features_length * (DRIFT_BINS - 1)];
+    hr_model->drift_proportions = new double[features_length * DRIFT_BINS];
+    hr_model->drift_threshold = DRIFT_THRESHOLD;
+    hr_model->reference_builds = 0;
+    hr_model->dataset_seconds = 0;
 
     return hr_model;
 }
 
-void update_hr_model(HR_Model* model, HR_Request** requests, int requests_count, bool verbose) {
-    std::lock_guard<std::mutex> lock(model->mtx);
+static std::string dataset_parameters(HR_Model* model) {
+    std::string parameters = "max_bin=255";
+    if (model->threads > 0) {
+        parameters += " num_threads=" + std::to_string(model->threads);
+    }
+    return parameters;
+}
 
-    if (model->available) {
-        LGBM_DatasetFree(*(model->dataset_handle));
-        LGBM_BoosterFree(*(model->booster_handle));
-        delete model->dataset_handle;
-        delete model->booster_handle;
+// Share of the sampled rows in each drift bin, features_length x DRIFT_BINS, in one pass over the rows
+static void drift_histograms(HR_Model* model, const HR_TrainingValue* features, int rows_count, double* proportions) {
+    int step = std::max(1, rows_count / DRIFT_SAMPLE_COUNT);
+    int sampled = 0;
+    std::fill(proportions, proportions + model->features_length * DRIFT_BINS, 0.0);
+    for (int i = 0; i < rows_count; i += step) {
+        const HR_TrainingValue* row = features + static_cast<long long>(i) * model->features_length;
+        for (int feature = 0; feature < model->features_length; feature++) {
+            // the edges are sorted, so the bin is the number of edges not above the value
+            const double* edges = model->drift_edges + feature * (DRIFT_BINS - 1);
+            int bin = 0;
+            for (int edge = 0; edge < DRIFT_BINS - 1; edge++) {
+                bin += edges[edge] <= row[feature];
+            }
+            proportions[feature * DRIFT_BINS + bin]++;
+        }
+        sampled++;
     }
+    for (int i = 0; i < model->features_length * DRIFT_BINS; i++) {
+        proportions[i] = std::max(proportions[i] / sampled, DRIFT_MINIMUM_PROPORTION);
+    }
+}
 
-    model->new_dataset_handle = new DatasetHandle;
-    model->new_booster_handle = new BoosterHandle;
+// Largest population stability index of a feature between the reference sample and these rows
+static double bins_drift(HR_Model* model, const HR_TrainingValue* features, int rows_count) {
+    std::vector<double> proportions(model->features_length * DRIFT_BINS);
+    drift_histograms(model, features, rows_count, proportions.data());
 
-    if (model->full) {
-        shuffle(model->data, model->data + model->max_train_set_count, std::mt19937{std::random_device{}()});
+    double drift = 0;
+    for (int feature = 0; feature < model->features_length; feature++) {
+        double psi = 0;
+        for (int bin = feature * DRIFT_BINS; bin < (feature + 1) * DRIFT_BINS; bin++) {
+            psi += (proportions[bin] - model->drift_proportions[bin]) * std::log(proportions[bin] / model->drift_proportions[bin]);
+        }
+        drift = std::max(drift, psi);
     }
+    return drift;
+}
 
-    for (int i = model->row_count; i < model->row_count + requests_count; i++) {
-        int row = i % model->max_train_set_count;
-        int request_index = i - model->row_count;
+static void build_reference_dataset(HR_Model* model, const HR_TrainingValue* features, int rows_count) {
+    int step = std::max(1, (rows_count + REFERENCE_SAMPLE_COUNT - 1) / REFERENCE_SAMPLE_COUNT);
+    int sampled = (rows_count + step - 1) / step;
+    std::vector<HR_TrainingValue> sample(static_cast<long long>(sampled) * model->features_length);
+    for (int i = 0; i < sampled; i++) {
+        memcpy(
+            sample.data() + static_cast<long long>(i) * model->features_length,
+            features + static_cast<long long>(i) * step * model->features_length,
+            sizeof(HR_TrainingValue) * model->features_length
+        );
+    }
 
-        // Shuffle the data when we reach the end of the array
-        if (row == 0 && i != 0) {
-            model->full = true;
-            shuffle(model->data, model->data + model->max_train_set_count, std::mt19937{std::random_device{}()});
-        }
+    if (model->reference_dataset) {
+        LGBM_DatasetFree(model->reference_dataset);
+    }
+    std::string parameters = dataset_parameters(model);
+    LGBM_DatasetCreateFromMat(
+        sample.data(),
+        HR_TRAINING_VALUE_TYPE,
+        sampled,
+        model->features_length,
+        1,
+        parameters.c_str(),
+        nullptr,
+        &model->reference_dataset
+    );
 
-        for (int j = 0; j < model->features_length; j++) {
-            model->data[row][j + 1] = requests[request_index]->features[j];
+    std::vector<double> column(sampled);
+    for (int feature = 0; feature < model->features_length; feature++) {
+        for (int i = 0; i < sampled; i++) {
+            column[i] = sample[static_cast<long long>(i) * model->features_length + feature];
+        }
+        std::sort(column.begin(), column.end());
+        double* edges = model->drift_edges + feature * (DRIFT_BINS - 1);
+        for (int bin = 1; bin < DRIFT_BINS; bin++) {
+            edges[bin - 1] = column[static_cast<long long>(sampled) * bin / DRIFT_BINS];
         }
-        model->data[row][0] = static_cast<double>((*requests[request_index]).label);
     }
-    model->row_count += requests_count;
-    model->row_count %= model->max_train_set_count;
-
-    int actual_row_count = model->full ? model->max_train_set_count : model->row_count;
+    drift_histograms(model, features, rows_count, model->drift_proportions);
+    model->reference_builds++;
+}
 
-    double *data = new double[actual_row_count * model->features_length];
-    float *labels = new float[actual_row_count];
-    for (int i = 0; i < actual_row_count; i++) {
-        for (int j = 0; j < model->features_length; j++) {
-            data[i * model->features_length + j] = model->data[i][j + 1];
+// Bins the rows with the reference bin mappers, rebuilding the reference first when the rows drifted from it
+static DatasetHandle create_training_dataset(HR_Model* model, const HR_TrainingValue* features, const float* labels, int rows_count, bool verbose) {
+    auto start = std::chrono::steady_clock::now();
+    if (!model->reference_dataset) {
+        build_reference_dataset(model, features, rows_count);
+    } else {
+        double drift = bins_drift(model, features, rows_count);
+        if (drift > model->drift_threshold) {
+            if (verbose) {
+                std::cout << "Feature drift " << drift << ", rebuilding the bins" << std::endl;
+            }
+            build_reference_dataset(model, features, rows_count);
         }
-        labels[i] = static_cast<float>(model->data[i][0]);
     }
 
+    DatasetHandle dataset_handle;
+    std::string parameters = dataset_parameters(model);
     LGBM_DatasetCreateFromMat(
-        data,
-        C_API_DTYPE_FLOAT64,
-        actual_row_count,
+        features,
+        HR_TRAINING_VALUE_TYPE,
+        rows_count,
         model->features_length,
         1,
-        "max_bin=255",
-        nullptr,
-        model->new_dataset_handle
+        parameters.c_str(),
+        model->reference_dataset,
+        &dataset_handle
     );
-    LGBM_DatasetSetField(*(model->new_dataset_handle), "label", labels, actual_row_count, C_API_DTYPE_FLOAT32);
+    LGBM_DatasetSetField(dataset_handle, "label", labels, rows_count, C_API_DTYPE_FLOAT32);
+    model->dataset_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return dataset_handle;
+}
 
-    delete[] data;
-    delete[] labels;
+// rows are the indexes of the training requests in the request features matrix and labels column
+void update_hr_model(HR_Model* model, const HR_FeatureValue* request_features, const int* request_labels, const int* rows, int rows_count, bool verbose) {
+    std::lock_guard<std::mutex> lock(model->mtx);
+
+    for (int i = 0; i < rows_count; i++) {
+        int row;
+        if (model->full) {
+            row = std::uniform_int_distribution<int>(0, model->max_train_set_count - 1)(model->random);
+        } else {
+            row = model->row_count++;
+            model->full = model->row_count == model->max_train_set_count;
+        }
 
-    train_hr_model(model, verbose);
+        int request = rows[i];
+        const HR_FeatureValue* request_row = request_features + static_cast<long long>(request) * model->features_length;
+        std::copy(request_row, request_row + model->features_length, model->features + static_cast<long long>(row) * model->features_length);
+        model->labels[row] = static_cast<float>(request_labels[request]);
+    }
+
+    if (model->row_count == 0) {
+        return;
+    }
+
+    // Only publishers replace the snapshot and they hold model->mtx, so it can be read directly
+    HR_ModelSnapshot* current = model->snapshot.load();
+    bool incremental = model->incremental_boost_round > 0 && current
+        && (model->full_rebuild_interval == 0 || model->trainings_since_rebuild + 1 < model->full_rebuild_interval);
+    if (incremental && rows_count == 0) {
+        return;
+    }
+
+    // The new booster is built off to the side; readers keep using the published one meanwhile
+    auto start = std::chrono::steady_clock::now();
+    HR_ModelSnapshot* snapshot = new HR_ModelSnapshot;
+
+    if (incremental) {
+        // The new rows are scattered in the store once it is full, so they are gathered from the window
+        std::vector<HR_TrainingValue> features(static_cast<long long>(rows_count) * model->features_length);
+        std::vector<float> labels(rows_count);
+        for (int i = 0; i < rows_count; i++) {
+            const HR_FeatureValue* request_row = request_features + static_cast<long long>(rows[i]) * model->features_length;
+            std::copy(request_row, request_row + model->features_length, features.data() + static_cast<long long>(i) * model->features_length);
+            labels[i] = static_cast<float>(request_labels[rows[i]]);
+        }
+
+        snapshot->dataset_handle = create_training_dataset(model, features.data(), labels.data(), rows_count, verbose);
+        continue_hr_model(model, snapshot, current, features.data(), rows_count, verbose);
+
+        model->trainings_since_rebuild++;
+        model->incremental_trainings++;
+        model->incremental_training_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        return;
+    }
+
+    snapshot->dataset_handle = create_training_dataset(model, model->features, model->labels, model->row_count, verbose);
+
+    train_hr_model(model, snapshot, verbose);
+
+    model->trainings_since_rebuild = 0;
+    model->full_trainings++;
+    model->full_training_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
 }
 
-void apply_new_model(HR_Model* model) {
-    DatasetHandle* temp_dataset_handle = model->dataset_handle;
-    BoosterHandle* temp_booster_handle = model->booster_handle;
-    model->dataset_handle = model->new_dataset_handle;
-    model->booster_handle = model->new_booster_handle;
+void free_snapshot(HR_ModelSnapshot* snapshot) {
+    if (snapshot->forest) {
+        destroy_forest(snapshot->forest);
+    }
+    LGBM_BoosterFree(snapshot->booster_handle);
+    LGBM_DatasetFree(snapshot->dataset_handle);
+    delete snapshot;
+}
+
+HR_ModelSnapshot* acquire_model(HR_Model* model, int* reader_slot) {
+    while (true) {
+        unsigned epoch = model->epoch.load();
+        model->readers[epoch & 1].count.fetch_add(1);
+        // A publisher flipped the epoch in between and may not wait for this slot, so retry
+        if (model->epoch.load() == epoch) {
+            *reader_slot = epoch & 1;
+            return model->snapshot.load();
+        }
+        model->readers[epoch & 1].count.fetch_sub(1);
+    }
+}
+
+void release_model(HR_Model* model, int reader_slot) {
+    model->readers[reader_slot].count.fetch_sub(1);
+}
+
+// Called with model->mtx held, so there is only one publisher at a time
+void apply_new_model(HR_Model* model, HR_ModelSnapshot* snapshot) {
+    HR_ModelSnapshot* old_snapshot = model->snapshot.exchange(snapshot);
     model->available = true;
+    if (!old_snapshot) {
+        return;
+    }
+
+    // Readers that may hold old_snapshot registered before the flip, in the old parity
+    unsigned epoch = model->epoch.fetch_add(1);
+    while (model->readers[epoch & 1].count.load() != 0) {
+        std::this_thread::yield();
+    }
+    free_snapshot(old_snapshot);
 }
 
-void train_hr_model(HR_Model* model, bool verbose) {
+static std::string predict_parameters(HR_Model* model) {
+    return model->threads > 0 ? "num_threads=" + std::to_string(model->threads) : "";
+}
+
+// Rows LightGBM can read: the features themselves when they are stored as training values,
+// otherwise a widened copy in buffer
+static const HR_TrainingValue* training_rows(const HR_FeatureValue* features, long long values_count, std::vector<HR_TrainingValue>& buffer) {
+    if (std::is_same<HR_FeatureValue, HR_TrainingValue>::value) {
+        return reinterpret_cast<const HR_TrainingValue*>(features);
+    }
+    buffer.assign(features, features + values_count);
+    return buffer.data();
+}
+
+static BoosterHandle boost_hr_model(HR_Model* model, DatasetHandle dataset_handle, int boost_rounds, bool verbose) {
     std::string parameters = "force_row_wise=true boosting_type=gbdt objective=binary learning_rate=0.1 num_leaves=32 max_depth=50 min_data_in_leaf=0";
     if (!verbose) {
         parameters += " verbosity=-1";
     }
+    if (model->threads > 0) {
+        parameters += " num_threads=" + std::to_string(model->threads);
+    }
     char* cparameters = new char[parameters.length() + 1];
     strcpy(cparameters, parameters.c_str());
 
-    LGBM_BoosterCreate(*(model->new_dataset_handle), cparameters, model->new_booster_handle);
+    BoosterHandle booster_handle;
+    LGBM_BoosterCreate(dataset_handle, cparameters, &booster_handle);
 
-    for (int i = 0; i < model->max_boost_round; ++i) {
+    for (int i = 0; i < boost_rounds; ++i) {
         int is_finished = 0;
-        LGBM_BoosterUpdateOneIter(*(model->new_booster_handle), &is_finished);
+        LGBM_BoosterUpdateOneIter(booster_handle, &is_finished);
         if (is_finished) break;
     }
     delete[] cparameters;
@@ -123,29 +321,85 @@ void train_hr_model(HR_Model* model, bool verbose) {
         std::cout << "[LightGBM] [Info] Training finished" << std::endl;
         std::cout << "------------------------" << std::endl;
     }
+    return booster_handle;
+}
+
+static HR_Forest* flatten_booster(HR_Model* model, BoosterHandle booster_handle, bool verbose) {
+    int64_t model_length = 0;
+    LGBM_BoosterSaveModelToString(booster_handle, 0, -1, 0, 0, &model_length, NULL);
+    std::string model_text(model_length, '\0');
+    LGBM_BoosterSaveModelToString(booster_handle, 0, -1, 0, model_length, &model_length, &model_text[0]);
 
-    apply_new_model(model);
+    HR_Forest* forest = create_forest(model_text, model->features_length);
+    if (!forest && verbose) {
+        std::cout << "The booster cannot be flattened, predicting with LightGBM" << std::endl;
+    }
+    return forest;
 }
 
-double predict_hr_label(HR_Model* model, double* features) {
-    std::lock_guard<std::mutex> lock(model->mtx);
+void train_hr_model(HR_Model* model, HR_ModelSnapshot* snapshot, bool verbose) {
+    snapshot->booster_handle = boost_hr_model(model, snapshot->dataset_handle, model->max_boost_round, verbose);
+    snapshot->forest = flatten_booster(model, snapshot->booster_handle, verbose);
+    apply_new_model(model, snapshot);
+}
+
+// Boosts on top of current: the rounds start from the raw scores current gives to the dataset rows,
+// then the trees of current are merged in front of the new ones
+void continue_hr_model(HR_Model* model, HR_ModelSnapshot* snapshot, HR_ModelSnapshot* current, const HR_TrainingValue* features, int rows_count, bool verbose) {
+    std::vector<double> init_scores(rows_count);
+    int64_t out_len;
+    std::string parameters = predict_parameters(model);
+    LGBM_BoosterPredictForMat(
+        current->booster_handle,
+        features,
+        HR_TRAINING_VALUE_TYPE,
+        rows_count,
+        model->features_length,
+        1,
+        C_API_PREDICT_RAW_SCORE,
+        0,
+        -1,
+        parameters.c_str(),
+        &out_len,
+        init_scores.data()
+    );
+    LGBM_DatasetSetField(snapshot->dataset_handle, "init_score", init_scores.data(), rows_count, C_API_DTYPE_FLOAT64);
+
+    snapshot->booster_handle = boost_hr_model(model, snapshot->dataset_handle, model->incremental_boost_round, verbose);
+    LGBM_BoosterMerge(snapshot->booster_handle, current->booster_handle);
+    snapshot->forest = flatten_booster(model, snapshot->booster_handle, verbose);
+    apply_new_model(model, snapshot);
+}
+
+double predict_hr_label(HR_Model* model, const HR_FeatureValue* features) {
+    int reader_slot;
+    HR_ModelSnapshot* snapshot = acquire_model(model, &reader_slot);
 
     double result;
+    if (snapshot->forest) {
+        predict_forest(snapshot->forest, features, 1, &result);
+        release_model(model, reader_slot);
+        return result;
+    }
+
+    std::vector<HR_TrainingValue> buffer;
+    std::string parameters = predict_parameters(model);
     int64_t out_len;
     int status = LGBM_BoosterPredictForMat(
-        *(model->booster_handle),
-        features,
-        C_API_DTYPE_FLOAT64,
+        snapshot->booster_handle,
+        training_rows(features, model->features_length, buffer),
+        HR_TRAINING_VALUE_TYPE,
         1,
         model->features_length,
         1,
         C_API_PREDICT_NORMAL,
         0,
         -1,
-        "",
+        parameters.c_str(),
         &out_len,
         &result
     );
+    release_model(model, reader_slot);
 
     if (status != 0) {
         // Handle the error. For example, you can print the status code
@@ -155,52 +409,53 @@ double predict_hr_label(HR_Model* model, double* features) {
     return result;
 }
 
-void predict_requests(HR_Model* model, HR_Request** requests, int requests_count) {
-    double* data = new double[requests_count * model->features_length];
-    for (int i = 0; i < requests_count; i++) {
-        for (int j = 0; j < model->features_length; j++) {
-            data[i * model->features_length + j] = requests[i]->features[j];
-        }
+// features is a requests_count x features_length row-major matrix, read in place
+void predict_requests(HR_Model* model, const HR_FeatureValue* features, int requests_count, double* probabilities) {
+    int reader_slot;
+    HR_ModelSnapshot* snapshot = acquire_model(model, &reader_slot);
+
+    if (snapshot->forest) {
+        predict_forest(snapshot->forest, features, requests_count, probabilities);
+        release_model(model, reader_slot);
+        return;
     }
 
-    double* result = new double[requests_count];
+    std::vector<HR_TrainingValue> buffer;
+    std::string parameters = predict_parameters(model);
     int64_t out_len;
     int status = LGBM_BoosterPredictForMat(
-        *(model->booster_handle),
-        data,
-        C_API_DTYPE_FLOAT64,
+        snapshot->booster_handle,
+        training_rows(features, static_cast<long long>(requests_count) * model->features_length, buffer),
+        HR_TRAINING_VALUE_TYPE,
         requests_count,
         model->features_length,
         1,
         C_API_PREDICT_NORMAL,
         0,
         -1,
-        "",
+        parameters.c_str(),
         &out_len,
-        result
+        probabilities
     );
+    release_model(model, reader_slot);
 
     if (status != 0) {
         // Handle the error. For example, you can print the status code
         fprintf(stderr, "[LightGBM] [Error] Prediction failed with error code: %d\n", status);
     }
-
-    for (int i = 0; i < requests_count; i++) {
-        requests[i]->admit_probability = result[i];
-    }
 }
 
 void destroy_hr_model(HR_Model* model) {
-    if (model->row_count > 0 || model->full) {
-        LGBM_DatasetFree(*(model->dataset_handle));
-        LGBM_BoosterFree(*(model->booster_handle));
-        delete model->dataset_handle;
-        delete model->booster_handle;
+    if (model->snapshot) {
+        free_snapshot(model->snapshot);
     }
 
-    for (int i = 0; i < model->max_train_set_count; i++) {
-        delete[] model->data[i];
+    if (model->reference_dataset) {
+        LGBM_DatasetFree(model->reference_dataset);
     }
-    delete[] model->data;
+    delete[] model->features;
+    delete[] model->labels;
+    delete[] model->drift_edges;
+    delete[] model->drift_proportions;
     delete model;
 }
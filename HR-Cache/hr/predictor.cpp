@@ -0,0 +1,171 @@
+#include "predictor.h"
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <iostream>
+
+// An idle predictor yields this many times before it starts sleeping between polls
+const int IDLE_SPINS = 64;
+const std::chrono::microseconds IDLE_SLEEP(20);
+
+static int log2_bucket(long long value, int buckets) {
+    int bucket = 0;
+    while (value > 1 && bucket < buckets - 1) {
+        value >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+static void score_batch(HR_Predictor* predictor, long long first, int count) {
+    int slot = first & (HR_PREDICTOR_CAPACITY - 1);
+    uint64_t start = latency_ticks();
+    predict_requests(
+        predictor->model,
+        predictor->features + static_cast<long long>(slot) * predictor->features_length,
+        count,
+        predictor->probabilities + slot
+    );
+    uint64_t now = record_stage(predictor->latencies, HR_STAGE_PREDICT, start);
+    double elapsed = ticks_to_nanoseconds(now - start) / 1e9;
+
+    HR_PredictorStats* stats = &predictor->stats[log2_bucket(count, HR_PREDICTOR_BATCH_BUCKETS)];
+    stats->batches++;
+    stats->requests += count;
+    stats->predict_ticks += now - start;
+    for (int i = slot; i < slot + count; i++) {
+        histogram_record(&stats->latencies, now - predictor->submit_times[i]);
+    }
+
+    if (elapsed > predictor->latency_target) {
+        predictor->batch_size = std::max(predictor->batch_size / 2, 1);
+    } else if (count == predictor->batch_size && elapsed < predictor->latency_target / 2) {
+        predictor->batch_size = std::min(predictor->batch_size * 2, HR_PREDICTOR_MAX_BATCH);
+    }
+}
+
+static void run_predictor(HR_Predictor* predictor) {
+    int idle = 0;
+    while (true) {
+        long long scored = predictor->scored.load(std::memory_order_relaxed);
+        long long submitted = predictor->submitted.load(std::memory_order_acquire);
+        if (submitted == scored) {
+            if (predictor->stopping.load()) {
+                return;
+            }
+            if (idle++ < IDLE_SPINS) {
+                std::this_thread::yield();
+            } else {
+                std::this_thread::sleep_for(IDLE_SLEEP);
+            }
+            continue;
+        }
+        idle = 0;
+
+        // a batch never wraps around the ring, so its features are contiguous
+        long long until_wrap = HR_PREDICTOR_CAPACITY - (scored & (HR_PREDICTOR_CAPACITY - 1));
+        int count = static_cast<int>(std::min({submitted - scored, static_cast<long long>(predictor->batch_size), until_wrap}));
+        score_batch(predictor, scored, count);
+        predictor->scored.store(scored + count, std::memory_order_release);
+    }
+}
+
+HR_Predictor* create_predictor(HR_Model* model, int features_length, double latency_target) {
+    HR_Predictor* predictor = new HR_Predictor;
+    predictor->model = model;
+    predictor->features_length = features_length;
+    predictor->latency_target = latency_target;
+    predictor->batch_size = 1;
+    predictor->requests = static_cast<HR_Request*>(malloc(sizeof(HR_Request) * HR_PREDICTOR_CAPACITY));
+    predictor->features = static_cast<HR_FeatureValue*>(malloc(sizeof(HR_FeatureValue) * HR_PREDICTOR_CAPACITY * features_length));
+    predictor->probabilities = static_cast<double*>(malloc(sizeof(double) * HR_PREDICTOR_CAPACITY));
+    predictor->submit_times = static_cast<uint64_t*>(malloc(sizeof(uint64_t) * HR_PREDICTOR_CAPACITY));
+    predictor->submitted = 0;
+    predictor->scored = 0;
+    predictor->applied = 0;
+    predictor->stopping = false;
+    for (HR_PredictorStats& stats : predictor->stats) {
+        stats.batches = 0;
+        stats.requests = 0;
+        stats.predict_ticks = 0;
+        for (std::atomic<uint64_t>& count : stats.latencies.counts) {
+            count.store(0, std::memory_order_relaxed);
+        }
+    }
+    predictor->latencies = create_latency_histograms();
+    // calibrated here rather than on the predictor thread in the middle of a batch
+    latency_ticks_per_nanosecond();
+    predictor->thread = std::thread(run_predictor, predictor);
+    return predictor;
+}
+
+bool predictor_submit(HR_Predictor* predictor, const HR_Request* request, const HR_FeatureValue* features) {
+    long long submitted = predictor->submitted.load(std::memory_order_relaxed);
+    if (submitted - predictor->applied == HR_PREDICTOR_CAPACITY) {
+        return false;
+    }
+
+    int slot = submitted & (HR_PREDICTOR_CAPACITY - 1);
+    predictor->requests[slot] = *request;
+    memcpy(
+        predictor->features + static_cast<long long>(slot) * predictor->features_length,
+        features,
+        sizeof(HR_FeatureValue) * predictor->features_length
+    );
+    predictor->submit_times[slot] = latency_ticks();
+    predictor->submitted.store(submitted + 1, std::memory_order_release);
+    return true;
+}
+
+bool predictor_next_scored(HR_Predictor* predictor, HR_Request* request) {
+    if (predictor->applied == predictor->scored.load(std::memory_order_acquire)) {
+        return false;
+    }
+
+    int slot = predictor->applied & (HR_PREDICTOR_CAPACITY - 1);
+    *request = predictor->requests[slot];
+    request->admit_probability = predictor->probabilities[slot];
+    predictor->applied++;
+    return true;
+}
+
+void predictor_flush(HR_Predictor* predictor) {
+    while (predictor->scored.load(std::memory_order_acquire) != predictor->submitted.load(std::memory_order_relaxed)) {
+        std::this_thread::yield();
+    }
+}
+
+void log_predictor_stats(HR_Predictor* predictor) {
+    std::cout << "Prediction batches (size: batches, reqs/s while predicting, p99 latency):" << std::endl;
+    for (int bucket = 0; bucket < HR_PREDICTOR_BATCH_BUCKETS; bucket++) {
+        HR_PredictorStats* stats = &predictor->stats[bucket];
+        if (stats->batches == 0) {
+            continue;
+        }
+
+        uint64_t counts[HR_HISTOGRAM_BUCKETS];
+        for (int i = 0; i < HR_HISTOGRAM_BUCKETS; i++) {
+            counts[i] = stats->latencies.counts[i].load(std::memory_order_relaxed);
+        }
+        int low = 1 << bucket;
+        int high = std::min((1 << (bucket + 1)) - 1, HR_PREDICTOR_MAX_BATCH);
+        std::cout << "  " << low;
+        if (high > low) {
+            std::cout << "-" << high;
+        }
+        std::cout << ": " << stats->batches << " batches, ";
+        std::cout << static_cast<long long>(1e9 * stats->requests / ticks_to_nanoseconds(stats->predict_ticks)) << " reqs/s, ";
+        std::cout << "p99 " << ticks_to_nanoseconds(histogram_percentile(counts, 0.99)) / 1e3 << " us" << std::endl;
+    }
+}
+
+void destroy_predictor(HR_Predictor* predictor) {
+    predictor->stopping = true;
+    predictor->thread.join();
+    free(predictor->requests);
+    free(predictor->features);
+    free(predictor->probabilities);
+    free(predictor->submit_times);
+    destroy_latency_histograms(predictor->latencies);
+    delete predictor;
+}
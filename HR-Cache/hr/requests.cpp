@@ -1,5 +1,6 @@
 #include "requests.h"
 #include "utils.h"
+#include "hazard_index.h"
 #include <thread>
 #include <string.h>
 #include <stdlib.h>
@@ -14,16 +15,35 @@
 #include <unordered_map>
 #include <cmath>
 #include <iomanip>
+#include <numeric>
+#include <limits>
 #include <set>
 
-const int num_threads = std::thread::hardware_concurrency();
-const long long MAXIMUM_PROCESS_COUNT = 10 * 1000 * 1000 * num_threads;
 const int MINIMUM_WINDOW_SIZE = 10 * 1000;
 const int MAXIMUM_WINDOW_SIZE = 10 * 1000 * 1000;
 const double MAX_SAMPLE_RATE = 1;
+// A hazard is recomputed every bandwidth / HAZARD_REFRESH_STEPS while it can change. This bounds
+// the work, not the drift in between, see HR_HazardIndex
+const int HAZARD_REFRESH_STEPS = 8;
+const double NEVER = std::numeric_limits<double>::infinity();
+// Every object's slice of the samples arena starts on a cache line
+const int SAMPLES_ARENA_ALIGNMENT = 64;
+const int SAMPLES_ARENA_STRIDE = SAMPLES_ARENA_ALIGNMENT / sizeof(double);
+// Hazard curves get a budget of points that grows with the intervals of the object, so their memory
+// stays proportional to the samples; objects whose curve does not fit keep the exact kernel sum
+const int HAZARD_CURVE_MINIMUM_POINTS = 64;
+const int HAZARD_CURVE_POINTS_PER_INTERVAL = 16;
+const int HAZARD_CURVE_MAXIMUM_POINTS = 4096;
 
 // double sum_h = 0;
 
+const int MINIMUM_WINDOW_CAPACITY = 1024;
+
+template <typename T>
+void grow_column(T*& column, long long capacity) {
+    column = static_cast<T*>(realloc(column, sizeof(T) * capacity));
+}
+
 HR_RequestWindow* create_request_window(
     int *size,
     long long cache_size,
@@ -36,11 +56,24 @@ HR_RequestWindow* create_request_window(
     rw->size = size;
     rw->cache_size = cache_size;
     rw->features_length = features_length;
-    rw->request = NULL;
     rw->requests_count = 0;
+    rw->requests_capacity = 0;
+    rw->timestamps = NULL;
+    rw->object_ids = NULL;
+    rw->objects_idx = NULL;
+    rw->sizes = NULL;
+    rw->labels = NULL;
+    rw->admit_probabilities = NULL;
+    rw->next_requests = NULL;
+    rw->request_features = NULL;
     rw->sampled_requests_count = 0;
     rw->objects_count = 0;
+    rw->objects_capacity = 0;
     rw->objects_size = 0;
+    rw->objects = NULL;
+    rw->objects_table = create_lookup_table(0);
+    rw->samples_arena = NULL;
+    rw->curves_arena = NULL;
     rw->objects_metadata = objects_metadata;
 
     int custom_features_count = 0;
@@ -57,62 +90,88 @@ HR_RequestWindow* create_request_window(
     return rw;
 }
 
+void grow_requests(HR_RequestWindow* request_window) {
+    long long capacity = std::max(2LL * request_window->requests_capacity, static_cast<long long>(MINIMUM_WINDOW_CAPACITY));
+    if (request_window->size) {
+        capacity = std::max(capacity, static_cast<long long>(*request_window->size) + 1);
+    }
+
+    grow_column(request_window->timestamps, capacity);
+    grow_column(request_window->object_ids, capacity);
+    grow_column(request_window->objects_idx, capacity);
+    grow_column(request_window->sizes, capacity);
+    grow_column(request_window->labels, capacity);
+    grow_column(request_window->admit_probabilities, capacity);
+    grow_column(request_window->next_requests, capacity);
+    grow_column(request_window->request_features, capacity * request_window->features_length);
+    request_window->requests_capacity = capacity;
+}
+
 void update_default_features(HR_RequestWindow* request_window) {    
-    for (const auto& pair : request_window->objects) {
-        Object* object = pair.second;
-        request_window->objects_metadata->update_features(object->id, object->request->prev->features);
+    for (int i = 0; i < request_window->objects_count; i++) {
+        Object* object = &request_window->objects[i];
+        request_window->objects_metadata->update_features(
+            object->id,
+            get_request_features(request_window, object->last_request)
+        );
     }
 }
 
-Object* create_object(HR_RequestWindow* request_window, int object_id, int size) {
-    Object* object = new Object;
+void init_object(Object* object, int object_id, int size) {
     object->id = object_id;
-    object->request = NULL;
+    object->first_request = HR_NULL_REQUEST;
+    object->last_request = HR_NULL_REQUEST;
     object->requests_count = 0;
     object->size = size;
     object->sampled = false;
     object->hazard_bandwidth = 3;
 
-    object->timestamps = NULL;
     object->timestamps_diffs = NULL;
     object->cumulative_hazards_diffs = NULL;
     object->diffs_count = 0;
-
-    return object;
+    object->hazard_curve.count = 0;
+    object->hazard_curve.values = NULL;
 }
 
 Object* get_object(HR_RequestWindow* request_window, const int object_id, int size) {
-    Object* object = request_window->objects[object_id];
-    if (object) {
-        return object;
+    int32_t idx = lookup_table_find(request_window->objects_table, object_id);
+    if (idx != HR_LOOKUP_TABLE_EMPTY) {
+        return &request_window->objects[idx];
+    }
+
+    if (request_window->objects_count == request_window->objects_capacity) {
+        request_window->objects_capacity = std::max(2 * request_window->objects_capacity, MINIMUM_WINDOW_CAPACITY);
+        grow_column(request_window->objects, request_window->objects_capacity);
     }
 
-    object = create_object(request_window, object_id, size);
-    object->idx = request_window->objects_count;
-    request_window->objects[object_id] = object;
+    idx = request_window->objects_count;
+    Object* object = &request_window->objects[idx];
+    init_object(object, object_id, size);
+    object->idx = idx;
+    lookup_table_insert(request_window->objects_table, object_id, idx);
     request_window->objects_count++;
     request_window->objects_size += size;
     return object;
 }
 
-void set_custom_features(HR_RequestWindow* request_window, HR_Request *request, Object *object) {
+void set_custom_features(HR_RequestWindow* request_window, HR_FeatureValue *features, int size, Object *object) {
     int custom_features_count = request_window->custom_features_count;
 
     if (request_window->features[FEAT_SIZE]) {
-        request->features[request_window->features_length - custom_features_count--] = request->size;
+        features[request_window->features_length - custom_features_count--] = encode_feature(size);
     }
     if (request_window->features[FEAT_FREQUENCY]) {
-        request->features[request_window->features_length - custom_features_count--] = 
-            static_cast<double>(object->requests_count) / request_window->requests_count;
+        features[request_window->features_length - custom_features_count--] = 
+            encode_feature(static_cast<double>(object->requests_count) / request_window->requests_count);
     }
     if (request_window->features[FEAT_DECAYED_FREQUENCY]) {
-        request->features[request_window->features_length - custom_features_count--] = 
-            request_window->objects_metadata->get_decayed_frequency(object->id);
+        features[request_window->features_length - custom_features_count--] = 
+            encode_feature(request_window->objects_metadata->get_decayed_frequency(object->id));
     }
 }
 
-HR_Request* add_request(HR_RequestWindow* request_window, int object_id, double timestamp, int size) {
-    request_window->objects_metadata->seen(object_id, timestamp);
+int add_request(HR_RequestWindow* request_window, int object_id, double timestamp, int size) {
+    request_window->objects_metadata->seen(object_id);
 
     double casted_size = static_cast<double>(size);
     if (request_window->requests_count == 1) {
@@ -121,63 +180,56 @@ HR_Request* add_request(HR_RequestWindow* request_window, int object_id, double
         request_window->avg_req_size = request_window->avg_req_size * (request_window->requests_count - 1) / request_window->requests_count + (casted_size / request_window->requests_count);
     }
 
-    request_window->requests_count++;
-    HR_Request* request = new HR_Request;
-    if (!request_window->request) {
-        request_window->request = request;
-        request->next_in_time = request;
-        request->prev_in_time = request;
-    } else {
-        HR_Request* end = request_window->request->prev_in_time;
-        end->next_in_time = request;
-        request->prev_in_time = end;
-        request->next_in_time = request_window->request;
-        request_window->request->prev_in_time = request;
+    if (request_window->requests_count == request_window->requests_capacity) {
+        grow_requests(request_window);
     }
+    int request = request_window->requests_count++;
+    request_window->object_ids[request] = object_id;
+    request_window->timestamps[request] = timestamp;
+    request_window->sizes[request] = size;
+    request_window->admit_probabilities[request] = 0;
+    request_window->labels[request] = 0;
+    request_window->next_requests[request] = HR_NULL_REQUEST;
+    HR_FeatureValue* features = get_request_features(request_window, request);
 
-    request->object_id = object_id;
-    request->timestamp = timestamp;
-    request->size = size;
-    request->admit_probability = 0;
-    request->label = 0;
-    request->features = new double[request_window->features_length];
-
-    Object* object = get_object(request_window, request->object_id, size);
+    Object* object = get_object(request_window, object_id, size);
     object->requests_count++;
+    request_window->objects_idx[request] = object->idx;
 
-    if (!object->request) {
-        object->request = request;
-        request->prev = request;
-        request->next = request;
+    if (object->first_request == HR_NULL_REQUEST) {
+        object->first_request = request;
+        object->last_request = request;
         
         memcpy(
-            request->features,
+            features,
             request_window->objects_metadata->get_features(object->id),
-            sizeof(double) * request_window->features_length
+            sizeof(HR_FeatureValue) * request_window->features_length
         );
     } else {
-        HR_Request* end = object->request->prev;
-        end->next = request;
-        request->prev = end;
-        request->next = object->request;
-        object->request->prev = request;
+        int32_t end = object->last_request;
+        HR_FeatureValue* end_features = get_request_features(request_window, end);
+        request_window->next_requests[end] = request;
+        object->last_request = request;
 
         if (request_window->features_length - request_window->custom_features_count > 0) {
             // Copy features from the previous request and shifting them to the left
-            memcpy(request->features, end->features + 1, sizeof(double) * (request_window->features_length - 1));
+            memcpy(features, end_features + 1, sizeof(HR_FeatureValue) * (request_window->features_length - 1));
             // Add the new timestamp diff feature to the end before the last two features
-            request->features[request_window->features_length - 1 - request_window->custom_features_count] = request->timestamp - end->timestamp;
+            features[request_window->features_length - 1 - request_window->custom_features_count] = encode_feature(timestamp - request_window->timestamps[end]);
         } else {
-            memcpy(request->features, end->features, sizeof(double) * request_window->features_length);
+            memcpy(features, end_features, sizeof(HR_FeatureValue) * request_window->features_length);
         }
     }
 
-    set_custom_features(request_window, request, object);
+    set_custom_features(request_window, features, size, object);
 
     return request;
 }
 
 double calculate_object_hazard(Object* object, double timestamp_diff) {
+    if (object->hazard_curve.count > 0) {
+        return hazard_curve_value(&object->hazard_curve, timestamp_diff);
+    }
     return calculate_hazard(
         timestamp_diff,
         object->timestamps_diffs,
@@ -187,94 +239,203 @@ double calculate_object_hazard(Object* object, double timestamp_diff) {
     );
 }
 
-void prepare_object_samples(Object* object, double last_timestamp, bool discrete) {
-    HR_Request* request = object->request;
-    for (int i = 0; i < object->requests_count; i++) {
-        object->timestamps[i] = request->timestamp;
-        request = request->next;
+// Writes the intervals between the requests of the object, and the censored one up to last_timestamp,
+// from slot 1 of its diffs; slot 0 is left for the fitter
+void gather_object_intervals(HR_RequestWindow* request_window, Object* object, double last_timestamp) {
+    int32_t request = object->first_request;
+    double previous_timestamp = request_window->timestamps[request];
+    for (int i = 1; i < object->requests_count; i++) {
+        request = request_window->next_requests[request];
+        object->timestamps_diffs[i] = request_window->timestamps[request] - previous_timestamp;
+        previous_timestamp = request_window->timestamps[request];
+    }
+    object->timestamps_diffs[object->requests_count] = last_timestamp - previous_timestamp;
+}
+
+// Next time the hazard of the object has to be recomputed, or NEVER when it stays 0 until its next request.
+// The kernel only reaches bandwidth away from the observed intervals, so the hazard is 0 for ages outside
+// [first interval - bandwidth, last interval + bandwidth].
+double next_hazard_refresh(Object* object, double last_timestamp, double timestamp) {
+    if (object->diffs_count <= 1) {
+        return NEVER;
     }
-    object->timestamps[object->requests_count] = last_timestamp;
 
-    calculate_diffs(object->timestamps, object->requests_count + 1, object->timestamps_diffs, &object->diffs_count);
-    nelson_aalen_fitter(object->timestamps_diffs, object->cumulative_hazards_diffs, &object->diffs_count, discrete);
+    double reach = object->hazard_bandwidth > 0 ? object->hazard_bandwidth : 0;
+    double age = timestamp - last_timestamp;
+    if (!(age <= object->timestamps_diffs[object->diffs_count - 1] + reach)) {
+        return NEVER;
+    }
+
+    double start = object->timestamps_diffs[1] - reach;
+    double next = age < start ? last_timestamp + start : timestamp + reach / HAZARD_REFRESH_STEPS;
+    return next > timestamp ? next : std::nextafter(timestamp, NEVER);
+}
 
-    // Calculate standard deviation
-    double mean = std::accumulate(object->timestamps_diffs, object->timestamps_diffs + object->diffs_count, 0.0) / object->diffs_count;
-    double sq_sum = std::inner_product(object->timestamps_diffs, object->timestamps_diffs + object->diffs_count, object->timestamps_diffs, 0.0);
-    double std_dev = std::sqrt(sq_sum / object->diffs_count - mean * mean);
+// Per thread labeling state
+struct HR_Labeler {
+    HR_HazardIndex* index;
+    double* last_timestamps;
+};
 
-    // Scott's rule for univariate data
-    object->hazard_bandwidth = 3.49 * std_dev / std::cbrt(object->diffs_count);
-    // sum_h += object->hazard_bandwidth;
+void refresh_object_hazard(HR_Labeler* labeler, Object* object, double timestamp) {
+    double last_timestamp = labeler->last_timestamps[object->idx];
+    hazard_index_set(labeler->index, object->idx, object->size, calculate_object_hazard(object, timestamp - last_timestamp));
+    hazard_index_schedule(labeler->index, object->idx, next_hazard_refresh(object, last_timestamp, timestamp));
 }
 
-void label_request(HR_RequestWindow* request_window, std::vector<Object*> *objects, HR_Request* request, double* last_timestamps) {
-    Object* current_object = request_window->objects[request->object_id];
+void label_request(HR_RequestWindow* request_window, HR_Labeler* labeler, int request) {
+    Object* current_object = &request_window->objects[request_window->objects_idx[request]];
+    double timestamp = request_window->timestamps[request];
+    double* last_timestamps = labeler->last_timestamps;
+    HR_HazardIndex* index = labeler->index;
+
+    int due_object;
+    while (hazard_index_next_due(index, timestamp, &due_object)) {
+        refresh_object_hazard(labeler, &request_window->objects[due_object], timestamp);
+    }
+
     if (current_object->requests_count <= 1) {
-        request->label = 0;
+        request_window->labels[request] = 0;
         return;
     }
 
     double current_hazard = calculate_object_hazard(
         current_object,
-        request->timestamp - last_timestamps[current_object->idx]
+        timestamp - last_timestamps[current_object->idx]
     );
     long long cache_size = static_cast<long long>(request_window->cache_size * request_window->sample_rate);
-    double current_size = 0;
-
-    for (int i = 0; i < objects->size(); ++i) {
-        Object* object = (*objects)[i];
 
-        if (object->id == current_object->id) {
-            continue;
-        }
+    // The current object sits in the bucket of its own hazard, so it is always part of the sum
+    hazard_index_set(index, current_object->idx, current_object->size, current_hazard);
+    double current_size = hazard_index_size_at_least(index, current_hazard) - current_object->size;
 
-        double hazard = calculate_object_hazard(
-            object,
-            request->timestamp - last_timestamps[object->idx]
-        );
-        if (hazard >= current_hazard) {
-            current_size += object->size;
-        }
-    }
-
-    if (current_size + request->size <= cache_size) {
-        request->label = 1;
+    int size = request_window->sizes[request];
+    if (current_size + size <= cache_size) {
+        request_window->labels[request] = 1;
     } else if (current_size < cache_size) {
-        double remained_fraction = (cache_size - current_size) / request->size;
+        double remained_fraction = (cache_size - current_size) / size;
         if ((double)rand() / RAND_MAX < remained_fraction) {
-            request->label = 1;
+            request_window->labels[request] = 1;
         } else {
-            request->label = 0;
+            request_window->labels[request] = 0;
         }
     } else {
-        request->label = 0;
+        request_window->labels[request] = 0;
     }
 }
 
-void prepare_objects(HR_RequestWindow* request_window, std::vector<Object*> *objects, bool discrete, bool verbose) {
-    std::thread threads[num_threads];
+// The fitter needs requests_count + 1 slots, rounded up so the next slice stays aligned
+long long samples_slice_size(Object* object) {
+    long long size = object->requests_count + 1;
+    return (size + SAMPLES_ARENA_STRIDE - 1) / SAMPLES_ARENA_STRIDE * SAMPLES_ARENA_STRIDE;
+}
+
+void prepare_objects(HR_RequestWindow* request_window, std::vector<Object*> *objects, bool discrete, double hazard_max_error, int num_threads, bool verbose) {
+    std::vector<std::thread> threads(num_threads);
 
-    double last_timestamp = request_window->request->prev_in_time->timestamp;
+    double last_timestamp = request_window->timestamps[request_window->requests_count - 1];
     int requests_count = request_window->requests_count;
     int objects_count = objects->size();
     int chunk_size = (objects_count + num_threads - 1) / num_threads;  // Round up division
 
+    // One arena holds the diffs and hazards of every sampled object, as two aligned columns
+    long long arena_size = 0;
+    std::vector<long long> offsets(objects_count);
+    std::vector<int> counts(objects_count);
+    std::vector<double> bandwidths(objects_count);
+    for (int i = 0; i < objects_count; ++i) {
+        offsets[i] = arena_size;
+        counts[i] = (*objects)[i]->requests_count;
+        arena_size += samples_slice_size((*objects)[i]);
+    }
+    request_window->samples_arena = static_cast<double*>(aligned_alloc(
+        SAMPLES_ARENA_ALIGNMENT,
+        sizeof(double) * std::max(2 * arena_size, static_cast<long long>(SAMPLES_ARENA_STRIDE))
+    ));
+
+    double* durations = request_window->samples_arena;
+    double* hazards = request_window->samples_arena + arena_size;
     for (int i = 0; i < objects_count; ++i) {
         Object* object = (*objects)[i];
-        object->timestamps = new double[object->requests_count + 2];
-        object->timestamps_diffs = new double[object->requests_count + 2];
-        object->cumulative_hazards_diffs = new double[object->requests_count + 2];
+        object->timestamps_diffs = durations + offsets[i];
+        object->cumulative_hazards_diffs = hazards + offsets[i];
+    }
+
+    for (int i = 0; i < num_threads; ++i) {
+        int chunk_start = std::min(i * chunk_size, objects_count);
+        int chunk_end = std::min(chunk_start + chunk_size, objects_count);
+
+        threads[i] = std::thread([&, chunk_start, chunk_end]() {
+            for (int j = chunk_start; j < chunk_end; ++j) {
+                gather_object_intervals(request_window, (*objects)[j], last_timestamp);
+            }
+            nelson_aalen_fit_segments(
+                durations,
+                hazards,
+                offsets.data() + chunk_start,
+                counts.data() + chunk_start,
+                bandwidths.data() + chunk_start,
+                chunk_end - chunk_start,
+                discrete
+            );
+            for (int j = chunk_start; j < chunk_end; ++j) {
+                (*objects)[j]->diffs_count = counts[j];
+                (*objects)[j]->hazard_bandwidth = bandwidths[j];
+            }
+        });
+    }
+
+    for (int i = 0; i < num_threads; ++i) {
+        threads[i].join();
+    }
+
+    // The curves can only be sized once the bandwidths are known
+    long long curves_size = 0;
+    int curves_count = 0;
+    std::vector<int> curves_points(objects_count);
+    for (int i = 0; i < objects_count; ++i) {
+        Object* object = (*objects)[i];
+        int max_points = std::max(HAZARD_CURVE_MINIMUM_POINTS, HAZARD_CURVE_POINTS_PER_INTERVAL * object->diffs_count);
+        curves_points[i] = hazard_curve_points(
+            object->timestamps_diffs,
+            object->diffs_count,
+            object->hazard_bandwidth,
+            hazard_max_error,
+            std::min(max_points, HAZARD_CURVE_MAXIMUM_POINTS)
+        );
+        curves_count += curves_points[i] > 0;
+        curves_size += (curves_points[i] + SAMPLES_ARENA_STRIDE - 1) / SAMPLES_ARENA_STRIDE * SAMPLES_ARENA_STRIDE;
+    }
+    request_window->curves_arena = static_cast<double*>(aligned_alloc(
+        SAMPLES_ARENA_ALIGNMENT,
+        sizeof(double) * std::max(curves_size, static_cast<long long>(SAMPLES_ARENA_STRIDE))
+    ));
+
+    double* curves_arena = request_window->curves_arena;
+    for (int i = 0; i < objects_count; ++i) {
+        (*objects)[i]->hazard_curve.values = curves_arena;
+        curves_arena += (curves_points[i] + SAMPLES_ARENA_STRIDE - 1) / SAMPLES_ARENA_STRIDE * SAMPLES_ARENA_STRIDE;
     }
 
     for (int i = 0; i < num_threads; ++i) {
         int chunk_start = i * chunk_size;
         int chunk_end = std::min(chunk_start + chunk_size, objects_count);
 
-        threads[i] = std::thread([objects, chunk_start, chunk_end, last_timestamp, discrete]() {
+        threads[i] = std::thread([objects, &curves_points, chunk_start, chunk_end]() {
+            HR_HazardBatch* batch = create_hazard_batch(0);
             for (int j = chunk_start; j < chunk_end; ++j) {
-                prepare_object_samples((*objects)[j], last_timestamp, discrete);
+                Object* object = (*objects)[j];
+                build_hazard_curve(
+                    &object->hazard_curve,
+                    batch,
+                    object->timestamps_diffs,
+                    object->cumulative_hazards_diffs,
+                    object->diffs_count,
+                    object->hazard_bandwidth,
+                    curves_points[j]
+                );
             }
+            destroy_hazard_batch(batch);
         });
     }
 
@@ -283,14 +444,15 @@ void prepare_objects(HR_RequestWindow* request_window, std::vector<Object*> *obj
     }
     if (verbose) {
         std::cout << "Number of objects prepared: " << objects_count << std::endl;
+        std::cout << "Hazard curves: " << curves_count << " objects, " << sizeof(double) * curves_size / 1e6 << " MB" << std::endl;
     }
     // std::cout << "sum_h: " << sum_h / objects_count << std::endl;
     // sum_h = 0;
 }
 
 void prepare_requests(HR_RequestWindow* request_window, std::vector<Object*> *objects, 
-        bool future_labeling, bool verbose) {
-    std::thread threads[num_threads];
+        bool future_labeling, int num_threads, bool verbose) {
+    std::vector<std::thread> threads(num_threads);
 
     int requests_count = request_window->sampled_requests_count;
     int chunk_size = (requests_count + num_threads - 1) / num_threads;  // Round up division
@@ -306,15 +468,35 @@ void prepare_requests(HR_RequestWindow* request_window, std::vector<Object*> *ob
         double* last_timestamps = last_timestamps_by_thread[i];
 
         threads[i] = std::thread([request_window, objects, chunk_start, chunk_end, last_timestamps]() {
+            if (chunk_start >= chunk_end) {
+                return;
+            }
+
+            // Objects not requested yet have an infinite age, hence a hazard of 0
+            std::fill(last_timestamps, last_timestamps + request_window->objects_count, -NEVER);
             for (int j = 0; j < chunk_start; ++j) {
-                last_timestamps[request_window->objects[request_window->sampled_requests[j]->object_id]->idx] = 
-                    request_window->sampled_requests[j]->timestamp;
+                int request = request_window->sampled_requests[j];
+                last_timestamps[request_window->objects_idx[request]] = request_window->timestamps[request];
             }
+
+            HR_Labeler labeler;
+            labeler.index = create_hazard_index(request_window->objects_count);
+            labeler.last_timestamps = last_timestamps;
+
+            double chunk_timestamp = request_window->timestamps[request_window->sampled_requests[chunk_start]];
+            for (int j = 0; j < objects->size(); ++j) {
+                refresh_object_hazard(&labeler, (*objects)[j], chunk_timestamp);
+            }
+
             for (int j = chunk_start; j < chunk_end; ++j) {
-                label_request(request_window, objects, request_window->sampled_requests[j], last_timestamps);
-                last_timestamps[request_window->objects[request_window->sampled_requests[j]->object_id]->idx] = 
-                    request_window->sampled_requests[j]->timestamp;
+                int request = request_window->sampled_requests[j];
+                label_request(request_window, &labeler, request);
+
+                Object* object = &request_window->objects[request_window->objects_idx[request]];
+                last_timestamps[object->idx] = request_window->timestamps[request];
+                refresh_object_hazard(&labeler, object, last_timestamps[object->idx]);
             }
+            destroy_hazard_index(labeler.index);
         });
     }
 
@@ -326,19 +508,16 @@ void prepare_requests(HR_RequestWindow* request_window, std::vector<Object*> *ob
     }
 
     if (future_labeling) {
+        int* labels = request_window->labels;
         for (int i = 0; i < objects->size(); ++i) {
             Object* object = (*objects)[i];
-            HR_Request* request = object->request;
-            while (request) {
-                if (request->next) {
-                    request->label = request->next->label;
-                }
-                request = request->next;
-
-                if (request == object->request) {
-                    break;
-                }
+            int32_t request = object->first_request;
+            while (request_window->next_requests[request] != HR_NULL_REQUEST) {
+                labels[request] = labels[request_window->next_requests[request]];
+                request = request_window->next_requests[request];
             }
+            // wrap around: the last request takes the (already shifted) label of the first one
+            labels[request] = labels[object->first_request];
         }
         if (verbose) {
             std::cout << "Future labeling done" << std::endl;
@@ -373,9 +552,7 @@ bool window_is_ready(HR_RequestWindow* request_window, double weight) {
 void sample_objects(std::vector<Object*> *objects, HR_RequestWindow* request_window, int limit, bool verbose) {
     // First we create an array of objects indexes 0..objects_count-1 and shuffle it
     // Then we iterate over objects and add them to the samples until we hit the limits
-    // We have two limits:
-    // 1. sampled objects * their total requests count should be lower than MAXIMUM_PROCESS_COUNT
-    // 2. total requests count of sampled requests should be lower than limit
+    // The total requests count of the sampled objects should be lower than limit
     // TODO: Shuffle or something like that is taking too much time for huge number of objects
     if (verbose) {
         std::cout << "Sampling objects & requests ..." << std::endl;
@@ -384,17 +561,17 @@ void sample_objects(std::vector<Object*> *objects, HR_RequestWindow* request_win
     const int max_requests_num = std::min(limit, static_cast<int>(MAX_SAMPLE_RATE * request_window->requests_count));
     const double estimated_sample_rate = static_cast<double>(max_requests_num) / static_cast<double>(request_window->requests_count);
 
-    int* object_ids = new int[request_window->objects_count];
-    for (const auto& pair : request_window->objects) {
-        object_ids[pair.second->idx] = pair.second->id;
+    int* object_idxs = new int[request_window->objects_count];
+    for (int i = 0; i < request_window->objects_count; ++i) {
+        object_idxs[i] = i;
     }
-    shuffle(object_ids, object_ids + request_window->objects_count, std::mt19937{std::random_device{}()});
+    shuffle(object_idxs, object_idxs + request_window->objects_count, std::mt19937{std::random_device{}()});
 
     double total_objects_size = 0;
     double objects_size = 0;
     request_window->sampled_requests_count = 0;
     for (int i = 0; i < request_window->objects_count; ++i) {
-        Object* object = request_window->objects[object_ids[i]];
+        Object* object = &request_window->objects[object_idxs[i]];
         total_objects_size += object->size;
 
         long long potential_requests_count = request_window->sampled_requests_count + object->requests_count;
@@ -403,10 +580,6 @@ void sample_objects(std::vector<Object*> *objects, HR_RequestWindow* request_win
             continue;
         }
 
-        if (potential_requests_count * (objects->size() + 1) > MAXIMUM_PROCESS_COUNT) {
-            continue;
-        }
-
         objects_size += object->size;
         object->sampled = true;
         objects->push_back(object);
@@ -414,71 +587,67 @@ void sample_objects(std::vector<Object*> *objects, HR_RequestWindow* request_win
     }
 
     request_window->sample_rate = objects_size / total_objects_size;
-    request_window->sampled_requests = new HR_Request*[request_window->sampled_requests_count];
+    request_window->sampled_requests = static_cast<int*>(malloc(sizeof(int) * request_window->sampled_requests_count));
     request_window->sampled_requests_count = 0;
-    HR_Request* request = request_window->request;
     for (int i = 0; i < request_window->requests_count; ++i) {
-        if (request_window->objects[request->object_id]->sampled) {
-            request_window->sampled_requests[request_window->sampled_requests_count++] = request;
+        if (request_window->objects[request_window->objects_idx[i]].sampled) {
+            request_window->sampled_requests[request_window->sampled_requests_count++] = i;
         }
-        request = request->next_in_time;
     }
 
     if (verbose) {
         std::cout << std::setprecision(5);
-        std::cout << "Number of threads: " << num_threads << std::endl;
         std::cout << "Average request size: " << request_window->avg_req_size << std::endl;
         std::cout << "HR_Requests count: " << request_window->requests_count << ", Objects count: " << request_window->objects_count << std::endl;
         std::cout << "Sampled objects: " << objects->size() << ", Sampled requests: " << request_window->sampled_requests_count << std::endl;
     }
 
-    delete[] object_ids;
+    delete[] object_idxs;
 }
 
 void prepare_request_window(HR_RequestWindow* request_window, int max_requests_count, double bandwidth, 
-        bool discrete, bool future_labeling, bool verbose) {
+        bool discrete, double hazard_max_error, bool future_labeling, int threads, bool verbose, HR_LatencyHistograms* latencies) {
+    int num_threads = threads > 0 ? threads : std::max(1u, std::thread::hardware_concurrency());
+    if (verbose) {
+        std::cout << "Number of threads: " << num_threads << std::endl;
+    }
     std::vector<Object*> objects;
+    uint64_t start = latency_ticks();
     sample_objects(&objects, request_window, max_requests_count, verbose);
-    prepare_objects(request_window, &objects, discrete, verbose);
-    prepare_requests(request_window, &objects, future_labeling, verbose);
+    if (latencies) {
+        start = record_stage(latencies, HR_STAGE_SAMPLE_OBJECTS, start);
+    }
+    prepare_objects(request_window, &objects, discrete, hazard_max_error, num_threads, verbose);
+    if (latencies) {
+        start = record_stage(latencies, HR_STAGE_PREPARE_OBJECTS, start);
+    }
+    prepare_requests(request_window, &objects, future_labeling, num_threads, verbose);
+    if (latencies) {
+        record_stage(latencies, HR_STAGE_PREPARE_REQUESTS, start);
+    }
 
     if (verbose) {
         double hr_bound = 0;
         for (int i = 0; i < request_window->sampled_requests_count; i++) {
-            hr_bound += request_window->sampled_requests[i]->label;
+            hr_bound += request_window->labels[request_window->sampled_requests[i]];
         }
         std::cout << "HR Bound: " << hr_bound / request_window->sampled_requests_count << std::endl;
     }
 }
 
 void destroy_request_window(HR_RequestWindow* request_window) {
-    HR_Request* request = request_window->request;
-    for (int i = 0; i < request_window->requests_count; i++) {
-        HR_Request* temp = request;
-        request = request->next_in_time;
-        delete[] temp->features;
-        delete temp;
-    }
-
-    for (const auto& pair : request_window->objects) {
-        Object* object = pair.second;
-        object->hazards.clear();
-        if (object->timestamps) {
-            delete[] object->timestamps;
-        }
-        if (object->timestamps_diffs) {
-            delete[] object->timestamps_diffs;
-        }
-        if (object->cumulative_hazards_diffs) {
-            delete[] object->cumulative_hazards_diffs;
-        }
-        delete object;
-    }
-
-    if (request_window->sampled_requests) {
-        delete[] request_window->sampled_requests;
-    }
-
-    request_window->objects.clear();
+    free(request_window->timestamps);
+    free(request_window->object_ids);
+    free(request_window->objects_idx);
+    free(request_window->sizes);
+    free(request_window->labels);
+    free(request_window->admit_probabilities);
+    free(request_window->next_requests);
+    free(request_window->request_features);
+    free(request_window->objects);
+    free(request_window->samples_arena);
+    free(request_window->curves_arena);
+    free(request_window->sampled_requests);
+    destroy_lookup_table(request_window->objects_table);
     delete request_window;
-}
\ No newline at end of file
+}
@@ -0,0 +1,56 @@
+#include "shards.h"
+#include "hr.h"
+#include <stdint.h>
+#include <functional>
+#include <mutex>
+
+HR_ShardedCache* create_sharded_hr(int shards_count, std::function<HRCache*(int shard, HR_Model* shared_model)> create_shard) {
+    HR_ShardedCache* sharded_hr = new HR_ShardedCache;
+    sharded_hr->shards_count = shards_count;
+    sharded_hr->shards = new HRCache*[shards_count];
+    sharded_hr->locks = new std::mutex[shards_count];
+
+    sharded_hr->shards[0] = create_shard(0, NULL);
+    sharded_hr->model = sharded_hr->shards[0]->model;
+    sharded_hr->shards[0]->owns_model = false;
+    for (int i = 1; i < shards_count; i++) {
+        sharded_hr->shards[i] = create_shard(i, sharded_hr->model);
+    }
+    return sharded_hr;
+}
+
+int get_shard(HR_ShardedCache* sharded_hr, int object_id) {
+    // murmur3 finalizer; the lookup tables inside a shard use fibonacci hashing of the same ids,
+    // so the shard must not be picked from the same bits
+    uint32_t hash = static_cast<uint32_t>(object_id);
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bu;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35u;
+    hash ^= hash >> 16;
+    return static_cast<int>((static_cast<uint64_t>(hash) * sharded_hr->shards_count) >> 32);
+}
+
+bool sharded_new_request(HR_ShardedCache* sharded_hr, double timestamp, int object_id, int size) {
+    int shard = get_shard(sharded_hr, object_id);
+    std::lock_guard<std::mutex> lock(sharded_hr->locks[shard]);
+    return new_request(sharded_hr->shards[shard], timestamp, object_id, size);
+}
+
+void destroy_sharded_hr(HR_ShardedCache* sharded_hr) {
+    // every shard may still be training the shared model
+    for (int i = 0; i < sharded_hr->shards_count; i++) {
+        if (sharded_hr->shards[i]->model_thread.joinable()) {
+            sharded_hr->shards[i]->model_thread.join();
+        }
+    }
+
+    for (int i = 0; i < sharded_hr->shards_count; i++) {
+        destroy_hr(sharded_hr->shards[i]);
+    }
+    destroy_hr_model(sharded_hr->model);
+
+    delete[] sharded_hr->shards;
+    delete[] sharded_hr->locks;
+    delete sharded_hr;
+}
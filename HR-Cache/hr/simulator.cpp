@@ -1,10 +1,173 @@
 #include "hr.h"
+#include "shards.h"
+#include "trace.h"
+#include "model.h"
 #include <iostream>
 #include <fstream>
 #include <sstream>
+#include <filesystem>
+#include <functional>
+#include <atomic>
+#include <mutex>
 #include <unordered_map>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <limits>
+#include <iomanip>
+
+// One configuration of a sweep, unset values fall back to the command line ones
+struct HR_SweepPoint {
+    std::optional<long long> cache_size;
+    std::optional<double> hot_lower_bound;
+    std::optional<double> cold_lower_bound;
+    std::optional<int> window_size;
+    std::optional<int> max_boost_rounds;
+};
+
+double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// The trace is split once by thread, each thread then replays only the requests of the shards
+// assigned to it, so each shard still sees its requests in trace order
+struct HR_ShardedRequest {
+    HR_TraceRequest request;
+    int shard;
+};
+
+int replay_sharded(const HR_Trace* trace, HR_ShardedCache* sharded_hr, int threads_count) {
+    auto partition_start = std::chrono::steady_clock::now();
+    std::vector<std::vector<HR_ShardedRequest>> thread_requests(threads_count);
+    for (std::vector<HR_ShardedRequest>& requests : thread_requests) {
+        requests.reserve(trace->header.requests_count / threads_count + 1);
+    }
+    HR_TraceCursor cursor = trace_cursor(trace);
+    HR_ShardedRequest sharded_request;
+    while (next_trace_request(&cursor, &sharded_request.request)) {
+        sharded_request.shard = get_shard(sharded_hr, sharded_request.request.object_id);
+        thread_requests[sharded_request.shard % threads_count].push_back(sharded_request);
+    }
+    double partition_elapsed = seconds_since(partition_start);
+
+    std::vector<std::thread> threads;
+    auto start = std::chrono::steady_clock::now();
+    for (int t = 0; t < threads_count; t++) {
+        threads.emplace_back([sharded_hr, &requests = thread_requests[t]]() {
+            for (const HR_ShardedRequest& sharded_request : requests) {
+                const HR_TraceRequest& request = sharded_request.request;
+                std::lock_guard<std::mutex> lock(sharded_hr->locks[sharded_request.shard]);
+                new_request(sharded_hr->shards[sharded_request.shard], request.timestamp, request.object_id, request.size);
+            }
+        });
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    double elapsed = seconds_since(start);
+
+    long long reqs = 0, reqs_hit = 0, bytes = 0, bytes_hit = 0;
+    std::cout << std::setprecision(5);
+    for (int i = 0; i < sharded_hr->shards_count; i++) {
+        HRCache* shard = sharded_hr->shards[i];
+        reqs += shard->analytics_reqs;
+        reqs_hit += shard->analytics_reqs_hit;
+        bytes += shard->analytics_bytes;
+        bytes_hit += shard->analytics_bytes_hit;
+        std::cout << "Shard " << i << ": reqs: " << shard->analytics_reqs;
+        if (shard->analytics_reqs > 0) {
+            std::cout << ", bytes miss: " << 100 - 100.0 * shard->analytics_bytes_hit / shard->analytics_bytes << "%";
+            std::cout << ", reqs miss: " << 100 - 100.0 * shard->analytics_reqs_hit / shard->analytics_reqs << "%";
+        }
+        std::cout << ", reqs/s: " << static_cast<long long>(shard->analytics_reqs / elapsed) << std::endl;
+    }
+
+    std::cout << "Shards: " << sharded_hr->shards_count << ", threads: " << threads_count << std::endl;
+    if (reqs > 0) {
+        std::cout << "Total bytes miss: " << 100 - 100.0 * bytes_hit / bytes << "%" << std::endl;
+        std::cout << "Total reqs miss: " << 100 - 100.0 * reqs_hit / reqs << "%" << std::endl;
+    }
+    std::cout << "Partition time: " << partition_elapsed << " s" << std::endl;
+    std::cout << "Replay time: " << elapsed << " s" << std::endl;
+    std::cout << "Total reqs/s: " << static_cast<long long>(reqs / elapsed) << std::endl;
+    std::cout << "------------------------" << std::endl;
+    return 0;
+}
+
+// Runs one independent HRCache per sweep point on a pool of threads, all replaying the same trace.
+// Each point buffers its analytics rows and appends them to the output in one go when it finishes.
+int replay_sweep(
+    const HR_Trace* trace,
+    int points_count,
+    int threads_count,
+    std::string output_file_name,
+    std::function<HRCache*(int point)> create_point
+) {
+    bool file_exists = std::filesystem::exists(output_file_name);
+    std::ofstream output(output_file_name, std::ios::app);
+    if (!output) {
+        std::cerr << "Unable to open file: " << output_file_name << std::endl;
+        return 1;
+    }
+    if (!file_exists) {
+        write_analytics_header(output);
+    }
+
+    threads_count = std::max(1, std::min(threads_count, points_count));
+    // Every point trains its own model and labels its own windows, so both get their share of the cores
+    // instead of all of them
+    int hardware_threads = static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+    int model_threads = std::max(1, hardware_threads / threads_count);
+
+    std::atomic<int> next_point(0);
+    std::mutex output_mutex;
+    std::vector<std::thread> threads;
+    auto start = std::chrono::steady_clock::now();
+    for (int t = 0; t < threads_count; t++) {
+        threads.emplace_back([&, t]() {
+            int point;
+            while ((point = next_point.fetch_add(1)) < points_count) {
+                auto point_start = std::chrono::steady_clock::now();
+                HRCache* hr = create_point(point);
+                std::ostringstream rows;
+                rows << std::setprecision(15);
+                hr->log_console = false;
+                hr->analytics_stream = &rows;
+                hr->model->threads = model_threads;
+                hr->labeling_threads = model_threads;
+
+                HR_TraceCursor cursor = trace_cursor(trace);
+                HR_TraceRequest request;
+                while (next_trace_request(&cursor, &request)) {
+                    new_request(hr, request.timestamp, request.object_id, request.size);
+                }
+                log_analytics(hr, true);
+
+                std::lock_guard<std::mutex> lock(output_mutex);
+                output << rows.str();
+                output.flush();
+                std::cout << std::setprecision(5);
+                std::cout << "Sweep point " << point + 1 << "/" << points_count << ": " << hr->key;
+                if (hr->cumulative_reqs > 0) {
+                    std::cout << ", total reqs miss: " << 100 - 100.0 * hr->cumulative_reqs_hits / hr->cumulative_reqs << "%";
+                }
+                std::cout << ", time: " << seconds_since(point_start) << " s" << std::endl;
+                destroy_hr(hr);
+            }
+        });
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+
+    std::cout << "Sweep points: " << points_count << ", threads: " << threads_count << std::endl;
+    std::cout << "Sweep time: " << seconds_since(start) << " s" << std::endl;
+    std::cout << "------------------------" << std::endl;
+    return 0;
+}
 
 int simulate(
+    const HR_Trace* trace,
     std::string file_path,
     std::optional<int> concurrency=std::nullopt,
     std::optional<bool> verbose=std::nullopt,
@@ -24,12 +187,107 @@ int simulate(
     std::optional<std::unordered_map<HR_FEATURE, bool>> features=std::nullopt,
     std::optional<int> report_interval=std::nullopt,
     std::optional<bool> log_file=std::nullopt,
-    std::optional<std::string> log_file_name=std::nullopt
+    std::optional<std::string> log_file_name=std::nullopt,
+    std::optional<HR_RetrainMode> retrain_mode=std::nullopt,
+    std::optional<int> incremental_boost_rounds=std::nullopt,
+    std::optional<int> full_rebuild_interval=std::nullopt,
+    std::optional<double> max_ttl=std::nullopt,
+    std::optional<int> rescore_budget=std::nullopt,
+    std::optional<bool> rescore_hot=std::nullopt,
+    std::optional<HR_PredictMode> predict_mode=std::nullopt,
+    std::optional<double> predict_latency_target=std::nullopt,
+    std::optional<double> hazard_max_error=std::nullopt,
+    std::optional<double> hot_max_idle=std::nullopt,
+    std::optional<int> demotion_steps=std::nullopt,
+    int shards=1,
+    int threads=1,
+    std::vector<HR_SweepPoint> sweep_points={}
 ) {
-    std::ifstream file(file_path);
-    if (!file) {
-        std::cerr << "Unable to open file: " << file_path << std::endl;
-        return 1;  // Return with error
+    if (!sweep_points.empty()) {
+        return replay_sweep(trace, sweep_points.size(), threads, log_file_name.value_or("analytics.csv"), [&](int point) {
+            HR_SweepPoint& sweep_point = sweep_points[point];
+            return create_hr(
+                file_path + "#" + std::to_string(point),
+                concurrency,
+                verbose,
+                sweep_point.cache_size.has_value() ? sweep_point.cache_size : cache_size,
+                sweep_point.hot_lower_bound.has_value() ? sweep_point.hot_lower_bound : hot_lower_bound,
+                sweep_point.cold_lower_bound.has_value() ? sweep_point.cold_lower_bound : cold_lower_bound,
+                evict_hot_for_cold,
+                sweep_point.window_size.has_value() ? &sweep_point.window_size.value() : window_size,
+                learning_rate,
+                features_length,
+                decay_factor,
+                hazard_bandwidth,
+                hazard_discrete,
+                future_labeling,
+                one_time_training,
+                sweep_point.max_boost_rounds.has_value() ? sweep_point.max_boost_rounds : max_boost_rounds,
+                features,
+                report_interval,
+                false,
+                false,
+                std::nullopt,
+                retrain_mode,
+                incremental_boost_rounds,
+                full_rebuild_interval,
+                max_ttl,
+                rescore_budget,
+                rescore_hot,
+                predict_mode,
+                predict_latency_target,
+                hazard_max_error,
+                hot_max_idle,
+                demotion_steps
+            );
+        });
+    }
+
+    if (shards > 1) {
+        // Shards split the cache and only report once the replay is over
+        long long shard_cache_size = cache_size.value_or(CACHE_SIZE) / shards;
+        HR_ShardedCache* sharded_hr = create_sharded_hr(shards, [&](int shard, HR_Model* shared_model) {
+            return create_hr(
+                file_path + "#" + std::to_string(shard),
+                concurrency,
+                verbose,
+                shard_cache_size,
+                hot_lower_bound,
+                cold_lower_bound,
+                evict_hot_for_cold,
+                window_size,
+                learning_rate,
+                features_length,
+                decay_factor,
+                hazard_bandwidth,
+                hazard_discrete,
+                future_labeling,
+                one_time_training,
+                max_boost_rounds,
+                features,
+                std::numeric_limits<int>::max(),
+                false,
+                false,
+                log_file_name,
+                retrain_mode,
+                incremental_boost_rounds,
+                full_rebuild_interval,
+                max_ttl,
+                rescore_budget,
+                rescore_hot,
+                predict_mode,
+                predict_latency_target,
+                hazard_max_error,
+                hot_max_idle,
+                demotion_steps,
+                shared_model
+            );
+        });
+        log_args(sharded_hr->shards[0]);
+
+        int has_error = replay_sharded(trace, sharded_hr, threads);
+        destroy_sharded_hr(sharded_hr);
+        return has_error;
     }
 
     HRCache* hr = create_hr(
@@ -53,40 +311,64 @@ int simulate(
         report_interval,
         log_file,
         false,
-        log_file_name
+        log_file_name,
+        retrain_mode,
+        incremental_boost_rounds,
+        full_rebuild_interval,
+        max_ttl,
+        rescore_budget,
+        rescore_hot,
+        predict_mode,
+        predict_latency_target,
+        hazard_max_error,
+        hot_max_idle,
+        demotion_steps
     );
     log_args(hr);
 
-    std::string line;
-    while (getline(file, line)) {
-        std::istringstream iss(line);
-        double timestamp;
-        int object_id, size;
-        if (!(iss >> timestamp >> object_id >> size)) {
-            std::cerr << "Error parsing line: " << line << std::endl;
-            break;
-        }
-
-        new_request(hr, timestamp, object_id, size);
+    HR_TraceCursor cursor = trace_cursor(trace);
+    HR_TraceRequest request;
+    while (next_trace_request(&cursor, &request)) {
+        new_request(hr, request.timestamp, request.object_id, request.size);
     }
     log_analytics(hr, true);
     destroy_hr(hr);
 
-    file.close();
     return 0;
 }
 
+std::vector<std::string> split_list(const std::string& list) {
+    std::vector<std::string> values;
+    std::istringstream iss(list);
+    std::string value;
+    while (getline(iss, value, ',')) {
+        if (!value.empty()) {
+            values.push_back(value);
+        }
+    }
+    return values;
+}
+
 int main(int argc, char* argv[]) {
     std::string file_path;
     int rounds = 1;
+    int shards = 1;
+    std::optional<int> threads;
     int* window_size = NULL;
     std::optional<std::string> log_file_name;
+    std::optional<HR_RetrainMode> retrain_mode;
+    std::optional<HR_PredictMode> predict_mode;
     std::optional<long long> cache_size;
-    std::optional<int> concurrency, features_length, report_interval, max_boost_rounds;
-    std::optional<double> learning_rate, hot_lower_bound, cold_lower_bound, hazard_bandwidth, decay_factor;
+    std::optional<int> concurrency, features_length, report_interval, max_boost_rounds, incremental_boost_rounds,
+        full_rebuild_interval, rescore_budget, demotion_steps;
+    std::optional<double> learning_rate, hot_lower_bound, cold_lower_bound, hazard_bandwidth, decay_factor, max_ttl,
+        predict_latency_target, hazard_max_error, hot_max_idle;
     std::optional<bool> verbose, evict_hot_for_cold, hazard_discrete, future_labeling, one_time_training, 
-        feature_frequency, feature_size;
+        feature_frequency, feature_size, rescore_hot;
     bool with_features = false;
+    bool sweep = false;
+    std::vector<std::string> sweep_cache_sizes, sweep_hot_lower_bounds, sweep_cold_lower_bounds, sweep_window_sizes,
+        sweep_max_boost_rounds;
 
     for (int i = 1; i < argc; ++i) {
         std::string arg = argv[i];
@@ -106,6 +388,12 @@ int main(int argc, char* argv[]) {
         if (arg.find("--rounds=") == 0) {
             rounds = stoi(arg.substr(strlen("--rounds=")));
         }
+        if (arg.find("--shards=") == 0) {
+            shards = stoi(arg.substr(strlen("--shards=")));
+        }
+        if (arg.find("--threads=") == 0) {
+            threads = stoi(arg.substr(strlen("--threads=")));
+        }
         if (arg.find("--cache-size=") == 0) {
             cache_size = stoll(arg.substr(strlen("--cache-size=")));
         }
@@ -134,6 +422,13 @@ int main(int argc, char* argv[]) {
         if (arg.find("--hazard-bandwidth=") == 0) {
             hazard_bandwidth = stod(arg.substr(strlen("--hazard-bandwidth=")));
         }
+        if (arg.find("--hazard-max-error=") == 0) {
+            hazard_max_error = stod(arg.substr(strlen("--hazard-max-error=")));
+            if (!(hazard_max_error.value() > 0)) {
+                std::cerr << "Hazard max error must be positive: " << arg.substr(strlen("--hazard-max-error=")) << std::endl;
+                return 1;
+            }
+        }
         if (arg.find("--hazard-discrete") == 0) {
             if (arg.find("--hazard-discrete=") == 0) {
                 hazard_discrete = arg.substr(strlen("--hazard-discrete=")) == "true";
@@ -158,6 +453,31 @@ int main(int argc, char* argv[]) {
         if (arg.find("--max-boost-rounds=") == 0) {
             max_boost_rounds = stoi(arg.substr(strlen("--max-boost-rounds=")));
         }
+        if (arg.find("--incremental-boost-rounds=") == 0) {
+            incremental_boost_rounds = stoi(arg.substr(strlen("--incremental-boost-rounds=")));
+        }
+        if (arg.find("--full-rebuild-interval=") == 0) {
+            full_rebuild_interval = stoi(arg.substr(strlen("--full-rebuild-interval=")));
+        }
+        if (arg.find("--max-ttl=") == 0) {
+            max_ttl = stod(arg.substr(strlen("--max-ttl=")));
+        }
+        if (arg.find("--hot-max-idle=") == 0) {
+            hot_max_idle = stod(arg.substr(strlen("--hot-max-idle=")));
+        }
+        if (arg.find("--demotion-steps=") == 0) {
+            demotion_steps = stoi(arg.substr(strlen("--demotion-steps=")));
+        }
+        if (arg.find("--rescore-budget=") == 0) {
+            rescore_budget = stoi(arg.substr(strlen("--rescore-budget=")));
+        }
+        if (arg.find("--rescore-hot") == 0) {
+            if (arg.find("--rescore-hot=") == 0) {
+                rescore_hot = arg.substr(strlen("--rescore-hot=")) == "true";
+            } else {
+                rescore_hot = true;
+            }
+        }
         if (arg.find("--feature-frequency") == 0) {
             with_features = true;
             if (arg.find("--feature-frequency=") == 0) {
@@ -184,6 +504,53 @@ int main(int argc, char* argv[]) {
         if (arg.find("--log-file=") == 0) {
             log_file_name = arg.substr(strlen("--log-file="));
         }
+        if (arg.find("--sweep-cache-size=") == 0) {
+            sweep = true;
+            sweep_cache_sizes = split_list(arg.substr(strlen("--sweep-cache-size=")));
+        }
+        if (arg.find("--sweep-hot-lower-bound=") == 0) {
+            sweep = true;
+            sweep_hot_lower_bounds = split_list(arg.substr(strlen("--sweep-hot-lower-bound=")));
+        }
+        if (arg.find("--sweep-cold-lower-bound=") == 0) {
+            sweep = true;
+            sweep_cold_lower_bounds = split_list(arg.substr(strlen("--sweep-cold-lower-bound=")));
+        }
+        if (arg.find("--sweep-window-size=") == 0) {
+            sweep = true;
+            sweep_window_sizes = split_list(arg.substr(strlen("--sweep-window-size=")));
+        }
+        if (arg.find("--sweep-max-boost-rounds=") == 0) {
+            sweep = true;
+            sweep_max_boost_rounds = split_list(arg.substr(strlen("--sweep-max-boost-rounds=")));
+        }
+        if (arg.find("--retrain-mode=") == 0) {
+            std::string mode = arg.substr(strlen("--retrain-mode="));
+            if (mode == "sync") {
+                retrain_mode = RETRAIN_SYNC;
+            } else if (mode == "async") {
+                retrain_mode = RETRAIN_ASYNC;
+            } else if (mode == "skip") {
+                retrain_mode = RETRAIN_SKIP;
+            } else {
+                std::cerr << "Unknown retrain mode: " << mode << std::endl;
+                return 1;
+            }
+        }
+        if (arg.find("--predict-mode=") == 0) {
+            std::string mode = arg.substr(strlen("--predict-mode="));
+            if (mode == "sync") {
+                predict_mode = PREDICT_SYNC;
+            } else if (mode == "pipeline") {
+                predict_mode = PREDICT_PIPELINE;
+            } else {
+                std::cerr << "Unknown predict mode: " << mode << std::endl;
+                return 1;
+            }
+        }
+        if (arg.find("--predict-latency-target=") == 0) {
+            predict_latency_target = stod(arg.substr(strlen("--predict-latency-target=")));
+        }
     }
 
     if (!file_path.empty()) {
@@ -202,9 +569,45 @@ int main(int argc, char* argv[]) {
         });
     }
 
+    // The grid is the cartesian product of the swept values; a parameter that is not swept keeps its single value
+    std::vector<HR_SweepPoint> sweep_points;
+    if (sweep) {
+        if (shards > 1) {
+            std::cerr << "Sweeps do not support shards" << std::endl;
+            return 1;
+        }
+        sweep_points.push_back(HR_SweepPoint());
+        auto expand = [&sweep_points](const std::vector<std::string>& values, std::function<void(HR_SweepPoint&, const std::string&)> set) {
+            if (values.empty()) {
+                return;
+            }
+            std::vector<HR_SweepPoint> expanded;
+            for (const HR_SweepPoint& point : sweep_points) {
+                for (const std::string& value : values) {
+                    expanded.push_back(point);
+                    set(expanded.back(), value);
+                }
+            }
+            sweep_points = expanded;
+        };
+        expand(sweep_cache_sizes, [](HR_SweepPoint& point, const std::string& value) { point.cache_size = stoll(value); });
+        expand(sweep_hot_lower_bounds, [](HR_SweepPoint& point, const std::string& value) { point.hot_lower_bound = stod(value); });
+        expand(sweep_cold_lower_bounds, [](HR_SweepPoint& point, const std::string& value) { point.cold_lower_bound = stod(value); });
+        expand(sweep_window_sizes, [](HR_SweepPoint& point, const std::string& value) { point.window_size = stoi(value); });
+        expand(sweep_max_boost_rounds, [](HR_SweepPoint& point, const std::string& value) { point.max_boost_rounds = stoi(value); });
+    }
+    int hardware_threads = static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+
+    // Text traces are parsed once here and binary traces are mapped, so rounds never re-read the file
+    HR_Trace* trace = open_trace(file_path);
+    if (!trace) {
+        return 1;
+    }
+
     for (int i = 0; i < rounds; ++i) {
         std::cout << "------------------------ Simulate Round " << i + 1 << " ------------------------" << std::endl;
         int has_error = simulate(
+            trace,
             file_path,
             concurrency,
             verbose,
@@ -224,11 +627,27 @@ int main(int argc, char* argv[]) {
             features,
             report_interval,
             log_file_name.value_or("") != "",
-            log_file_name
+            log_file_name,
+            retrain_mode,
+            incremental_boost_rounds,
+            full_rebuild_interval,
+            max_ttl,
+            rescore_budget,
+            rescore_hot,
+            predict_mode,
+            predict_latency_target,
+            hazard_max_error,
+            hot_max_idle,
+            demotion_steps,
+            shards,
+            threads.value_or(sweep ? hardware_threads : std::min(shards, hardware_threads)),
+            sweep_points
         );
         if (has_error) {
+            close_trace(trace);
             return has_error;
         }
     }
+    close_trace(trace);
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,210 @@
+#include "timing_wheel.h"
+#include <stdlib.h>
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include <vector>
+
+// Timers that expired and were not popped yet wait in one more list after the buckets
+const int32_t DUE_BUCKET = HR_TIMING_WHEEL_LEVELS * HR_TIMING_WHEEL_SLOTS;
+const int MINIMUM_TIMERS_CAPACITY = 1024;
+
+static long long level_span(int level) {
+    return 1LL << (HR_TIMING_WHEEL_BITS * level);
+}
+
+HR_TimingWheel* create_timing_wheel(double tick) {
+    HR_TimingWheel* wheel = new HR_TimingWheel;
+    wheel->tick = tick;
+    wheel->current = 0;
+    wheel->started = false;
+    wheel->heads = static_cast<int32_t*>(malloc(sizeof(int32_t) * (DUE_BUCKET + 1)));
+    std::fill(wheel->heads, wheel->heads + DUE_BUCKET + 1, HR_TIMING_WHEEL_NONE);
+    std::fill(wheel->levels_counts, wheel->levels_counts + HR_TIMING_WHEEL_LEVELS, 0);
+    wheel->count = 0;
+    wheel->next = NULL;
+    wheel->prev = NULL;
+    wheel->buckets = NULL;
+    wheel->expiries = NULL;
+    wheel->capacity = 0;
+    return wheel;
+}
+
+static void grow_timers(HR_TimingWheel* wheel, int32_t timer) {
+    int capacity = std::max(2 * wheel->capacity, MINIMUM_TIMERS_CAPACITY);
+    while (capacity <= timer) {
+        capacity *= 2;
+    }
+    wheel->next = static_cast<int32_t*>(realloc(wheel->next, sizeof(int32_t) * capacity));
+    wheel->prev = static_cast<int32_t*>(realloc(wheel->prev, sizeof(int32_t) * capacity));
+    wheel->buckets = static_cast<int32_t*>(realloc(wheel->buckets, sizeof(int32_t) * capacity));
+    wheel->expiries = static_cast<long long*>(realloc(wheel->expiries, sizeof(long long) * capacity));
+    std::fill(wheel->buckets + wheel->capacity, wheel->buckets + capacity, HR_TIMING_WHEEL_NONE);
+    wheel->capacity = capacity;
+}
+
+static void link_timer(HR_TimingWheel* wheel, int32_t timer, int32_t bucket) {
+    int32_t head = wheel->heads[bucket];
+    wheel->next[timer] = head;
+    wheel->prev[timer] = HR_TIMING_WHEEL_NONE;
+    if (head != HR_TIMING_WHEEL_NONE) {
+        wheel->prev[head] = timer;
+    }
+    wheel->heads[bucket] = timer;
+    wheel->buckets[timer] = bucket;
+}
+
+static void unlink_timer(HR_TimingWheel* wheel, int32_t timer) {
+    int32_t bucket = wheel->buckets[timer];
+    if (bucket != DUE_BUCKET) {
+        wheel->levels_counts[bucket / HR_TIMING_WHEEL_SLOTS]--;
+    }
+    if (wheel->prev[timer] != HR_TIMING_WHEEL_NONE) {
+        wheel->next[wheel->prev[timer]] = wheel->next[timer];
+    } else {
+        wheel->heads[bucket] = wheel->next[timer];
+    }
+    if (wheel->next[timer] != HR_TIMING_WHEEL_NONE) {
+        wheel->prev[wheel->next[timer]] = wheel->prev[timer];
+    }
+    wheel->buckets[timer] = HR_TIMING_WHEEL_NONE;
+}
+
+// Buckets the timer by its distance from the current tick; a timer already late goes to the current tick
+static void place_timer(HR_TimingWheel* wheel, int32_t timer) {
+    long long distance = std::max(wheel->expiries[timer] - wheel->current, 0LL);
+    distance = std::min(distance, level_span(HR_TIMING_WHEEL_LEVELS) - 1);
+    int level = 0;
+    while (level < HR_TIMING_WHEEL_LEVELS - 1 && distance >= level_span(level + 1)) {
+        level++;
+    }
+    long long position = wheel->current + distance;
+    int slot = (position >> (HR_TIMING_WHEEL_BITS * level)) & (HR_TIMING_WHEEL_SLOTS - 1);
+    link_timer(wheel, timer, level * HR_TIMING_WHEEL_SLOTS + slot);
+    wheel->levels_counts[level]++;
+}
+
+static void restart_wheel(HR_TimingWheel* wheel, long long tick) {
+    std::vector<int32_t> timers;
+    for (int32_t bucket = 0; bucket < DUE_BUCKET; bucket++) {
+        for (int32_t timer = wheel->heads[bucket]; timer != HR_TIMING_WHEEL_NONE; timer = wheel->next[timer]) {
+            timers.push_back(timer);
+        }
+        wheel->heads[bucket] = HR_TIMING_WHEEL_NONE;
+    }
+    std::fill(wheel->levels_counts, wheel->levels_counts + HR_TIMING_WHEEL_LEVELS, 0);
+    wheel->current = tick;
+    for (int32_t timer : timers) {
+        place_timer(wheel, timer);
+    }
+}
+
+void timing_wheel_schedule(HR_TimingWheel* wheel, int32_t timer, double time) {
+    if (timer >= wheel->capacity) {
+        grow_timers(wheel, timer);
+    }
+    timing_wheel_cancel(wheel, timer);
+    if (time == std::numeric_limits<double>::infinity()) {
+        return;
+    }
+
+    // rounded up, so a timer never fires before its time
+    long long expiry = static_cast<long long>(std::ceil(time / wheel->tick));
+    if (!wheel->started && (wheel->count == 0 || expiry < wheel->current)) {
+        // Before the first advance the wheel starts at the earliest expiry
+        restart_wheel(wheel, expiry);
+    }
+    wheel->expiries[timer] = expiry;
+    place_timer(wheel, timer);
+    wheel->count++;
+}
+
+void timing_wheel_cancel(HR_TimingWheel* wheel, int32_t timer) {
+    if (timer >= wheel->capacity || wheel->buckets[timer] == HR_TIMING_WHEEL_NONE) {
+        return;
+    }
+    unlink_timer(wheel, timer);
+    wheel->count--;
+}
+
+// Moves the timers of the buckets that start at the current tick one level down, higher levels first
+// since they may feed the lower ones, then makes the timers of the current tick due
+static void process_tick(HR_TimingWheel* wheel) {
+    long long tick = wheel->current;
+    for (int level = HR_TIMING_WHEEL_LEVELS - 1; level > 0; level--) {
+        if ((tick & (level_span(level) - 1)) != 0) {
+            continue;
+        }
+        int32_t bucket = level * HR_TIMING_WHEEL_SLOTS + ((tick >> (HR_TIMING_WHEEL_BITS * level)) & (HR_TIMING_WHEEL_SLOTS - 1));
+        int32_t timer = wheel->heads[bucket];
+        wheel->heads[bucket] = HR_TIMING_WHEEL_NONE;
+        while (timer != HR_TIMING_WHEEL_NONE) {
+            int32_t next = wheel->next[timer];
+            wheel->levels_counts[level]--;
+            place_timer(wheel, timer);
+            timer = next;
+        }
+    }
+
+    int32_t bucket = tick & (HR_TIMING_WHEEL_SLOTS - 1);
+    int32_t timer = wheel->heads[bucket];
+    wheel->heads[bucket] = HR_TIMING_WHEEL_NONE;
+    while (timer != HR_TIMING_WHEEL_NONE) {
+        int32_t next = wheel->next[timer];
+        wheel->levels_counts[0]--;
+        link_timer(wheel, timer, DUE_BUCKET);
+        timer = next;
+    }
+}
+
+bool timing_wheel_next_due(HR_TimingWheel* wheel, double time, int32_t* timer) {
+    long long target = static_cast<long long>(std::floor(time / wheel->tick));
+    if (!wheel->started) {
+        // timers scheduled so far are placed from the earliest of them, which may be later than time
+        if (wheel->count == 0 || target < wheel->current) {
+            restart_wheel(wheel, target);
+        }
+        wheel->started = true;
+    }
+
+    while (wheel->heads[DUE_BUCKET] == HR_TIMING_WHEEL_NONE) {
+        if (wheel->current > target) {
+            return false;
+        }
+        if (wheel->count == 0) {
+            wheel->current = target + 1;
+            return false;
+        }
+
+        // Nothing happens before the next bucket boundary of the lowest level holding timers
+        int level = 0;
+        while (level < HR_TIMING_WHEEL_LEVELS - 1 && wheel->levels_counts[level] == 0) {
+            level++;
+        }
+        long long span = level_span(level);
+        long long remainder = ((wheel->current % span) + span) % span;
+        long long next_tick = remainder ? wheel->current + span - remainder : wheel->current;
+        if (next_tick > target) {
+            wheel->current = target + 1;
+            return false;
+        }
+
+        wheel->current = next_tick;
+        process_tick(wheel);
+        wheel->current++;
+    }
+
+    *timer = wheel->heads[DUE_BUCKET];
+    unlink_timer(wheel, *timer);
+    wheel->count--;
+    return true;
+}
+
+void destroy_timing_wheel(HR_TimingWheel* wheel) {
+    free(wheel->heads);
+    free(wheel->next);
+    free(wheel->prev);
+    free(wheel->buckets);
+    free(wheel->expiries);
+    delete wheel;
+}
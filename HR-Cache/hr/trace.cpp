@@ -0,0 +1,253 @@
+#include "trace.h"
+#include <iostream>
+#include <fstream>
+#include <charconv>
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+const int64_t MINIMUM_TEXT_RECORDS_CAPACITY = 1024;
+
+static const char* skip_blanks(const char* p, const char* end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r')) {
+        p++;
+    }
+    return p;
+}
+
+// Floating point from_chars is missing from older libc++ (Apple's before Xcode 14.3), which only
+// leaves the integer overloads; strtod then parses a copy of the field bounded to its own buffer
+static std::from_chars_result parse_timestamp(const char* p, const char* end, double* timestamp) {
+#if defined(__cpp_lib_to_chars) && __cpp_lib_to_chars >= 201611L
+    return std::from_chars(p, end, *timestamp);
+#else
+    char field[64];
+    size_t length = 0;
+    while (p + length < end && length < sizeof(field) - 1 && !strchr(" \t\r\n", p[length])) {
+        field[length] = p[length];
+        length++;
+    }
+    field[length] = '\0';
+    char* field_end;
+    *timestamp = strtod(field, &field_end);
+    bool truncated = p + length < end && !strchr(" \t\r\n", p[length]);
+    std::from_chars_result result;
+    result.ptr = p + (field_end - field);
+    result.ec = field_end == field || truncated ? std::errc::invalid_argument : std::errc();
+    return result;
+#endif
+}
+
+// Parses "timestamp object_id size" lines; anything after the third field is ignored
+static bool parse_text_trace(HR_Trace* trace, const char* p, const char* end) {
+    int64_t capacity = std::max(MINIMUM_TEXT_RECORDS_CAPACITY, static_cast<int64_t>((end - p) / 16));
+    HR_TraceRecord* records = static_cast<HR_TraceRecord*>(malloc(sizeof(HR_TraceRecord) * capacity));
+    int64_t count = 0;
+
+    while (p < end) {
+        const char* line = p;
+        p = skip_blanks(p, end);
+        if (p < end && *p == '\n') {
+            p++;
+            continue;
+        }
+
+        if (count == capacity) {
+            capacity *= 2;
+            records = static_cast<HR_TraceRecord*>(realloc(records, sizeof(HR_TraceRecord) * capacity));
+        }
+        HR_TraceRecord& record = records[count];
+
+        std::from_chars_result result = parse_timestamp(p, end, &record.timestamp);
+        bool parsed = result.ec == std::errc();
+        if (parsed) {
+            result = std::from_chars(skip_blanks(result.ptr, end), end, record.object_id);
+            parsed = result.ec == std::errc();
+        }
+        if (parsed) {
+            result = std::from_chars(skip_blanks(result.ptr, end), end, record.size);
+            parsed = result.ec == std::errc();
+        }
+        const char* line_end = static_cast<const char*>(memchr(line, '\n', end - line));
+        if (!line_end) {
+            line_end = end;
+        }
+        if (!parsed) {
+            std::cerr << "Error parsing line: " << std::string(line, line_end - line) << std::endl;
+            break;
+        }
+
+        count++;
+        p = line_end + 1;
+    }
+
+    trace->buffer = reinterpret_cast<char*>(records);
+    trace->records = trace->buffer;
+    trace->header.magic = HR_TRACE_MAGIC;
+    trace->header.version = HR_TRACE_VERSION;
+    trace->header.flags = 0;
+    trace->header.record_size = sizeof(HR_TraceRecord);
+    trace->header.reserved = 0;
+    trace->header.requests_count = count;
+    trace->header.base_timestamp = count > 0 ? records[0].timestamp : 0;
+    return true;
+}
+
+static bool read_binary_trace(HR_Trace* trace, const std::string& file_path) {
+    const char* data = static_cast<const char*>(trace->mapping);
+    memcpy(&trace->header, data, sizeof(HR_TraceHeader));
+
+    uint32_t record_size = (trace->header.flags & HR_TRACE_DELTA) ? sizeof(HR_TraceDeltaRecord) : sizeof(HR_TraceRecord);
+    if (trace->header.version != HR_TRACE_VERSION || trace->header.record_size != record_size) {
+        std::cerr << "Unsupported trace version " << trace->header.version << ": " << file_path << std::endl;
+        return false;
+    }
+    size_t records_size = static_cast<size_t>(trace->header.requests_count) * record_size;
+    if (trace->header.requests_count < 0 || trace->mapping_size < sizeof(HR_TraceHeader) + records_size) {
+        std::cerr << "Truncated trace: " << file_path << std::endl;
+        return false;
+    }
+
+    trace->records = data + sizeof(HR_TraceHeader);
+    madvise(trace->mapping, trace->mapping_size, MADV_SEQUENTIAL);
+    return true;
+}
+
+HR_Trace* open_trace(const std::string& file_path) {
+    int fd = open(file_path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        std::cerr << "Unable to open file: " << file_path << std::endl;
+        return NULL;
+    }
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0) {
+        std::cerr << "Unable to open file: " << file_path << std::endl;
+        close(fd);
+        return NULL;
+    }
+
+    HR_Trace* trace = new HR_Trace;
+    memset(&trace->header, 0, sizeof(HR_TraceHeader));
+    trace->records = NULL;
+    trace->mapping = NULL;
+    trace->mapping_size = file_stat.st_size;
+    trace->buffer = NULL;
+
+    if (trace->mapping_size > 0) {
+        trace->mapping = mmap(NULL, trace->mapping_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (trace->mapping == MAP_FAILED) {
+        std::cerr << "Unable to map file: " << file_path << std::endl;
+        trace->mapping = NULL;
+        close_trace(trace);
+        return NULL;
+    }
+
+    uint32_t magic = 0;
+    if (trace->mapping_size >= sizeof(HR_TraceHeader)) {
+        memcpy(&magic, trace->mapping, sizeof(magic));
+    }
+
+    bool opened;
+    if (magic == HR_TRACE_MAGIC) {
+        opened = read_binary_trace(trace, file_path);
+    } else {
+        const char* data = static_cast<const char*>(trace->mapping);
+        opened = parse_text_trace(trace, data, data + trace->mapping_size);
+        // the text is not needed once it is parsed
+        if (trace->mapping) {
+            munmap(trace->mapping, trace->mapping_size);
+            trace->mapping = NULL;
+        }
+    }
+
+    if (!opened) {
+        close_trace(trace);
+        return NULL;
+    }
+    return trace;
+}
+
+// Delta records need every timestamp to be reproduced exactly from the previous one
+static bool fits_delta(const HR_Trace* trace) {
+    HR_TraceCursor cursor = trace_cursor(trace);
+    HR_TraceRequest request;
+    double previous = trace->header.base_timestamp;
+    while (next_trace_request(&cursor, &request)) {
+        double delta = request.timestamp - previous;
+        if (!(delta >= 0) || delta > UINT32_MAX || delta != std::floor(delta)
+            || previous + static_cast<uint32_t>(delta) != request.timestamp) {
+            return false;
+        }
+        previous = request.timestamp;
+    }
+    return true;
+}
+
+bool write_trace(const HR_Trace* trace, const std::string& file_path, bool delta) {
+    if (delta && !fits_delta(trace)) {
+        std::cerr << "Timestamps are not integral and non-decreasing, writing plain records" << std::endl;
+        delta = false;
+    }
+
+    std::ofstream file(file_path, std::ios::binary | std::ios::trunc);
+    if (!file) {
+        std::cerr << "Unable to open file: " << file_path << std::endl;
+        return false;
+    }
+
+    HR_TraceHeader header = trace->header;
+    header.magic = HR_TRACE_MAGIC;
+    header.version = HR_TRACE_VERSION;
+    header.flags = delta ? HR_TRACE_DELTA : 0;
+    header.record_size = delta ? sizeof(HR_TraceDeltaRecord) : sizeof(HR_TraceRecord);
+    header.reserved = 0;
+    file.write(reinterpret_cast<const char*>(&header), sizeof(HR_TraceHeader));
+
+    HR_TraceCursor cursor = trace_cursor(trace);
+    HR_TraceRequest request;
+    double previous = header.base_timestamp;
+    while (next_trace_request(&cursor, &request)) {
+        if (delta) {
+            HR_TraceDeltaRecord record = {
+                static_cast<uint32_t>(request.timestamp - previous),
+                request.object_id,
+                request.size
+            };
+            file.write(reinterpret_cast<const char*>(&record), sizeof(record));
+            previous = request.timestamp;
+        } else {
+            HR_TraceRecord record = {request.timestamp, request.object_id, request.size};
+            file.write(reinterpret_cast<const char*>(&record), sizeof(record));
+        }
+    }
+
+    file.close();
+    if (!file) {
+        std::cerr << "Unable to write file: " << file_path << std::endl;
+        return false;
+    }
+    return true;
+}
+
+HR_TraceCursor trace_cursor(const HR_Trace* trace) {
+    HR_TraceCursor cursor;
+    cursor.trace = trace;
+    cursor.position = 0;
+    cursor.timestamp = trace->header.base_timestamp;
+    return cursor;
+}
+
+void close_trace(HR_Trace* trace) {
+    if (trace->mapping) {
+        munmap(trace->mapping, trace->mapping_size);
+    }
+    free(trace->buffer);
+    delete trace;
+}
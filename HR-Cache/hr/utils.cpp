@@ -4,16 +4,34 @@
 #include <iostream>
 #include <limits>
 #include <algorithm>
+#include <string>
+#include <cmath>
+#include <vector>
+#include <stdint.h>
 #include <sys/resource.h>
 
 #if defined(__APPLE__)
 #include <mach/mach.h>
 #endif
 
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
 
 const double HAZARD_CONST = 3.0 / 4;
 const double EPSILON = std::numeric_limits<double>::min();
 
+const int HAZARD_SIMD_MINIMUM_COUNT = 8;
+const double SCOTT_FACTOR = 3.49;
+
+const int INSERTION_SORT_MAXIMUM_COUNT = 32;
+const int RADIX_BITS = 8;
+const int RADIX_BUCKETS = 1 << RADIX_BITS;
+const int RADIX_PASSES = 64 / RADIX_BITS;
+
+typedef double (*HR_HazardScanKernel)(double input, const double* timestamps_diffs, const double* cumulative_hazards_diffs, int first, int diffs_count, double bandwidth);
+
 void report_memory() {
     struct rusage rusage;
     getrusage(RUSAGE_SELF, &rusage);
@@ -50,29 +68,88 @@ void calculate_diffs(const double *input, const int input_count, double *interva
     *diff_count = input_count - 1;
 }
 
-int qsort_compare(const void *a, const void *b) {
-    double arg1 = *reinterpret_cast<const double*>(a);
-    double arg2 = *reinterpret_cast<const double*>(b);
+static void insertion_sort(double* values, int count) {
+    for (int i = 1; i < count; i++) {
+        double value = values[i];
+        int j = i - 1;
+        while (j >= 0 && values[j] > value) {
+            values[j + 1] = values[j];
+            j--;
+        }
+        values[j + 1] = value;
+    }
+}
+
+// LSD radix sort on the bit patterns, which order like the values for non-negative doubles.
+// Every digit histogram is built in one pass and the digits all keys share are skipped.
+static void radix_sort(double* values, int count, std::vector<uint64_t>& scratch) {
+    scratch.resize(2 * static_cast<size_t>(count));
+    uint64_t* keys = scratch.data();
+    uint64_t* buffer = keys + count;
+    memcpy(keys, values, sizeof(double) * count);
+
+    uint32_t histograms[RADIX_PASSES][RADIX_BUCKETS] = {};
+    for (int i = 0; i < count; i++) {
+        for (int pass = 0; pass < RADIX_PASSES; pass++) {
+            histograms[pass][(keys[i] >> (pass * RADIX_BITS)) & (RADIX_BUCKETS - 1)]++;
+        }
+    }
+
+    for (int pass = 0; pass < RADIX_PASSES; pass++) {
+        uint32_t* histogram = histograms[pass];
+        int shift = pass * RADIX_BITS;
+        if (histogram[(keys[0] >> shift) & (RADIX_BUCKETS - 1)] == static_cast<uint32_t>(count)) {
+            continue;
+        }
+
+        uint32_t position = 0;
+        for (int bucket = 0; bucket < RADIX_BUCKETS; bucket++) {
+            uint32_t bucket_count = histogram[bucket];
+            histogram[bucket] = position;
+            position += bucket_count;
+        }
+        for (int i = 0; i < count; i++) {
+            buffer[histogram[(keys[i] >> shift) & (RADIX_BUCKETS - 1)]++] = keys[i];
+        }
+        std::swap(keys, buffer);
+    }
+    memcpy(values, keys, sizeof(double) * count);
+}
 
-    if(arg1 < arg2) return -1;
-    if(arg1 > arg2) return 1;
-    return 0;
+static void sort_durations(double* values, int count, std::vector<uint64_t>& scratch) {
+    if (count <= INSERTION_SORT_MAXIMUM_COUNT) {
+        insertion_sort(values, count);
+        return;
+    }
+    for (int i = 0; i < count; i++) {
+        // negative zeros, negative values and NaNs do not sort by their bits
+        if (std::signbit(values[i]) || std::isnan(values[i])) {
+            std::sort(values, values + count);
+            return;
+        }
+    }
+    radix_sort(values, count, scratch);
 }
 
-void nelson_aalen_fitter(double* durations, double* hazards, int* data_count, bool discrete) { 
-    // Sort the data array in ascending order of durations
-    double last_duration = durations[*data_count - 1];
-    qsort(durations, *data_count, sizeof(double), qsort_compare);
-    
-    double risk_set_size = *data_count;
-    int i = 0;
-    int j = 0;
-    while(i < *data_count) {
+// Fits one segment: durations[1..*data_count] are the intervals, the last one censored.
+// The distinct durations and their hazards are compacted from slot 1, after the 0 of slot 0,
+// and the Scott's rule bandwidth is computed over them in the same pass.
+static void nelson_aalen_fit_segment(double* durations, double* hazards, int* data_count, double* bandwidth, bool discrete, std::vector<uint64_t>& scratch) {
+    int count = *data_count;
+    double last_duration = durations[count];
+    sort_durations(durations + 1, count, scratch);
+
+    double risk_set_size = count;
+    double sum = 0;
+    double sq_sum = 0;
+    int i = 1;
+    int j = 1;
+    while (i <= count) {
         double current_duration = durations[i];
         int event_count = 0;
         int missed_count = 0;
         // Count the number of events and censored observations at the current duration
-        while(i < *data_count && durations[i] == current_duration) {
+        while (i <= count && durations[i] == current_duration) {
             event_count++;
             i++;
         }
@@ -89,24 +166,43 @@ void nelson_aalen_fitter(double* durations, double* hazards, int* data_count, bo
             }
         }
 
-        // Update the cumulative hazard and risk set size
         risk_set_size -= event_count + missed_count;
-        // Store the cumulative hazard for all observations at the current duration
         durations[j] = current_duration;
         hazards[j] = hazard;
+        sum += current_duration;
+        sq_sum += current_duration * current_duration;
         j++;
     }
+    durations[0] = 0.0;
+    hazards[0] = 0.0;
     *data_count = j;
 
-    // Add 0 to the beginning of the durations
-    memmove(durations + 1, durations, sizeof(double) * (*data_count));
-    durations[0] = 0.0;
+    double mean = sum / j;
+    double std_dev = std::sqrt(sq_sum / j - mean * mean);
+    // Scott's rule for univariate data
+    *bandwidth = SCOTT_FACTOR * std_dev / std::cbrt(j);
+}
 
-    // Add 0 to the beginning of the cumulative hazards
-    memmove(hazards + 1, hazards, sizeof(double) * (*data_count));
-    hazards[0] = 0.0;
+void nelson_aalen_fitter(double* durations, double* hazards, int* data_count, bool discrete) {
+    std::vector<uint64_t> scratch;
+    double bandwidth;
+    memmove(durations + 1, durations, sizeof(double) * (*data_count));
+    nelson_aalen_fit_segment(durations, hazards, data_count, &bandwidth, discrete, scratch);
+}
 
-    *data_count += 1;
+void nelson_aalen_fit_segments(
+    double* durations,
+    double* hazards,
+    const long long* offsets,
+    int* counts,
+    double* bandwidths,
+    int segments_count,
+    bool discrete
+) {
+    std::vector<uint64_t> scratch;
+    for (int i = 0; i < segments_count; i++) {
+        nelson_aalen_fit_segment(durations + offsets[i], hazards + offsets[i], &counts[i], &bandwidths[i], discrete, scratch);
+    }
 }
 
 double simple_calculate_hazard(double input, double* timestamps_diffs, double* cumulative_hazards_diffs, int diffs_count, double bandwidth) {
@@ -122,25 +218,276 @@ double simple_calculate_hazard(double input, double* timestamps_diffs, double* c
     return result;
 }
 
-double calculate_hazard(double input, double* timestamps_diffs, double* cumulative_hazards_diffs, int diffs_count, double bandwidth) {
+// Epanechnikov kernel sum over the intervals in [first, last), the scalar reference for the batch kernels
+static double hazard_range_scalar(double input, const double* timestamps_diffs, const double* cumulative_hazards_diffs, int first, int last, double bandwidth) {
+    double result = 0;
+    double constant = HAZARD_CONST / bandwidth;
+    for (int i = first; i < last; i++) {
+        double hazard = (input - timestamps_diffs[i]) / bandwidth;
+        result += constant * (1 - (hazard * hazard)) * cumulative_hazards_diffs[i];
+    }
+    return result;
+}
+
+// The batch kernels start at the first interval within bandwidth of input and scan until the intervals
+// leave it, instead of searching for the end. Per term they do the same operations as the scalar
+// reference; the SIMD ones only sum the terms in a different order.
+static double hazard_scan_scalar(double input, const double* timestamps_diffs, const double* cumulative_hazards_diffs, int first, int diffs_count, double bandwidth) {
+    double upper_bound_value = input + bandwidth + EPSILON;
+    double result = 0;
+    double constant = HAZARD_CONST / bandwidth;
+    for (int i = first; i < diffs_count && timestamps_diffs[i] <= upper_bound_value; i++) {
+        double hazard = (input - timestamps_diffs[i]) / bandwidth;
+        result += constant * (1 - (hazard * hazard)) * cumulative_hazards_diffs[i];
+    }
+    return result;
+}
+
+#if defined(__x86_64__)
+// No fused multiply-adds: 1 - h * h loses its rounding step near the kernel edges and drifts from the reference
+__attribute__((target("avx2"), optimize("fp-contract=off")))
+static double hazard_scan_avx2(double input, const double* timestamps_diffs, const double* cumulative_hazards_diffs, int first, int diffs_count, double bandwidth) {
+    double upper_bound_value = input + bandwidth + EPSILON;
+    double constant = HAZARD_CONST / bandwidth;
+    __m256d inputs = _mm256_set1_pd(input);
+    __m256d upper_bounds = _mm256_set1_pd(upper_bound_value);
+    __m256d bandwidths = _mm256_set1_pd(bandwidth);
+    __m256d constants = _mm256_set1_pd(constant);
+    __m256d ones = _mm256_set1_pd(1.0);
+    __m256d sums = _mm256_setzero_pd();
+
+    int i = first;
+    bool in_range = true;
+    for (; in_range && i + 4 <= diffs_count; i += 4) {
+        __m256d diffs = _mm256_loadu_pd(timestamps_diffs + i);
+        __m256d mask = _mm256_cmp_pd(diffs, upper_bounds, _CMP_LE_OQ);
+        __m256d hazards = _mm256_div_pd(_mm256_sub_pd(inputs, diffs), bandwidths);
+        __m256d kernels = _mm256_mul_pd(constants, _mm256_sub_pd(ones, _mm256_mul_pd(hazards, hazards)));
+        __m256d terms = _mm256_mul_pd(kernels, _mm256_loadu_pd(cumulative_hazards_diffs + i));
+        sums = _mm256_add_pd(sums, _mm256_and_pd(terms, mask));
+        in_range = _mm256_movemask_pd(mask) == 0xf;
+    }
+
+    __m128d pairs = _mm_add_pd(_mm256_castpd256_pd128(sums), _mm256_extractf128_pd(sums, 1));
+    double result = _mm_cvtsd_f64(_mm_add_sd(pairs, _mm_unpackhi_pd(pairs, pairs)));
+    for (; in_range && i < diffs_count && timestamps_diffs[i] <= upper_bound_value; i++) {
+        double hazard = (input - timestamps_diffs[i]) / bandwidth;
+        result += constant * (1 - (hazard * hazard)) * cumulative_hazards_diffs[i];
+    }
+    return result;
+}
+
+__attribute__((target("avx512f"), optimize("fp-contract=off")))
+static double hazard_scan_avx512(double input, const double* timestamps_diffs, const double* cumulative_hazards_diffs, int first, int diffs_count, double bandwidth) {
+    double upper_bound_value = input + bandwidth + EPSILON;
+    double constant = HAZARD_CONST / bandwidth;
+    __m512d inputs = _mm512_set1_pd(input);
+    __m512d upper_bounds = _mm512_set1_pd(upper_bound_value);
+    __m512d bandwidths = _mm512_set1_pd(bandwidth);
+    __m512d constants = _mm512_set1_pd(constant);
+    __m512d ones = _mm512_set1_pd(1.0);
+    __m512d sums = _mm512_setzero_pd();
+
+    for (int i = first; i < diffs_count; i += 8) {
+        // the lanes past the end of the intervals are never loaded
+        __mmask8 loaded = diffs_count - i >= 8 ? 0xff : static_cast<__mmask8>((1u << (diffs_count - i)) - 1);
+        __m512d diffs = _mm512_maskz_loadu_pd(loaded, timestamps_diffs + i);
+        __mmask8 mask = _mm512_mask_cmp_pd_mask(loaded, diffs, upper_bounds, _CMP_LE_OQ);
+        __m512d hazards = _mm512_div_pd(_mm512_sub_pd(inputs, diffs), bandwidths);
+        __m512d kernels = _mm512_mul_pd(constants, _mm512_sub_pd(ones, _mm512_mul_pd(hazards, hazards)));
+        sums = _mm512_mask_add_pd(sums, mask, sums, _mm512_mul_pd(kernels, _mm512_maskz_loadu_pd(mask, cumulative_hazards_diffs + i)));
+        if (mask != 0xff) {
+            break;
+        }
+    }
+    // _mm512_reduce_add_pd starts from an undefined vector, which GCC warns about
+    alignas(64) double lanes[8];
+    _mm512_store_pd(lanes, sums);
+    return ((lanes[0] + lanes[4]) + (lanes[2] + lanes[6])) + ((lanes[1] + lanes[5]) + (lanes[3] + lanes[7]));
+}
+#endif
+
+// HR_HAZARD_KERNEL=scalar|avx2|avx512 forces a kernel, otherwise the widest one the CPU supports is used
+static HR_HazardScanKernel select_hazard_kernel(const char** name) {
+    const char* forced = getenv("HR_HAZARD_KERNEL");
+    std::string kernel = forced ? forced : "";
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if ((kernel.empty() || kernel == "avx512") && __builtin_cpu_supports("avx512f")) {
+        *name = "avx512";
+        return hazard_scan_avx512;
+    }
+    if ((kernel.empty() || kernel == "avx2") && __builtin_cpu_supports("avx2")) {
+        *name = "avx2";
+        return hazard_scan_avx2;
+    }
+#endif
+    *name = "scalar";
+    return hazard_scan_scalar;
+}
+
+static const char* hazard_kernel = NULL;
+static const HR_HazardScanKernel hazard_scan_kernel = select_hazard_kernel(&hazard_kernel);
+
+const char* hazard_kernel_name() {
+    return hazard_kernel;
+}
+
+// Intervals are sorted, so only [first, last) is within bandwidth of input
+static bool hazard_range(double input, const double* timestamps_diffs, int diffs_count, double bandwidth, int* first, int* last) {
     double lower_bound_value = input - bandwidth;
     double upper_bound_value = input + bandwidth + EPSILON;
     
     // Use lower_bound to find the first index where timestamps_diffs[i] >= lower_bound_value
-    int first = std::lower_bound(timestamps_diffs, timestamps_diffs + diffs_count, lower_bound_value) - timestamps_diffs;
+    *first = std::lower_bound(timestamps_diffs, timestamps_diffs + diffs_count, lower_bound_value) - timestamps_diffs;
 
-    if (first == diffs_count || timestamps_diffs[first] > upper_bound_value) {
-        return 0;
+    if (*first == diffs_count || timestamps_diffs[*first] > upper_bound_value) {
+        return false;
     }
 
     // Use upper_bound to find the first index where timestamps_diffs[i] < upper_bound_value
-    int last = std::upper_bound(timestamps_diffs, timestamps_diffs + diffs_count, upper_bound_value) - timestamps_diffs;
+    *last = std::upper_bound(timestamps_diffs, timestamps_diffs + diffs_count, upper_bound_value) - timestamps_diffs;
+    return true;
+}
 
-    double result = 0;
-    double constant = HAZARD_CONST / bandwidth;
-    for (int i = first; i < last; i++) {
-        double hazard = (input - timestamps_diffs[i]) / bandwidth;
-        result += constant * (1 - (hazard * hazard)) * cumulative_hazards_diffs[i];
+double calculate_hazard(double input, double* timestamps_diffs, double* cumulative_hazards_diffs, int diffs_count, double bandwidth) {
+    int first, last;
+    if (!hazard_range(input, timestamps_diffs, diffs_count, bandwidth, &first, &last)) {
+        return 0;
     }
-    return result;
-}
\ No newline at end of file
+    return hazard_range_scalar(input, timestamps_diffs, cumulative_hazards_diffs, first, last, bandwidth);
+}
+
+HR_HazardBatch* create_hazard_batch(int capacity) {
+    HR_HazardBatch* batch = new HR_HazardBatch;
+    batch->count = 0;
+    batch->capacity = 0;
+    batch->inputs = NULL;
+    batch->timestamps_diffs = NULL;
+    batch->cumulative_hazards_diffs = NULL;
+    batch->diffs_counts = NULL;
+    batch->bandwidths = NULL;
+    batch->hazards = NULL;
+    reserve_hazard_batch(batch, capacity);
+    return batch;
+}
+
+void reserve_hazard_batch(HR_HazardBatch* batch, int capacity) {
+    if (capacity <= batch->capacity) {
+        return;
+    }
+    batch->capacity = std::max(capacity, 2 * batch->capacity);
+    batch->inputs = static_cast<double*>(realloc(batch->inputs, sizeof(double) * batch->capacity));
+    batch->timestamps_diffs = static_cast<const double**>(realloc(batch->timestamps_diffs, sizeof(double*) * batch->capacity));
+    batch->cumulative_hazards_diffs = static_cast<const double**>(realloc(batch->cumulative_hazards_diffs, sizeof(double*) * batch->capacity));
+    batch->diffs_counts = static_cast<int*>(realloc(batch->diffs_counts, sizeof(int) * batch->capacity));
+    batch->bandwidths = static_cast<double*>(realloc(batch->bandwidths, sizeof(double) * batch->capacity));
+    batch->hazards = static_cast<double*>(realloc(batch->hazards, sizeof(double) * batch->capacity));
+}
+
+int add_hazard_query(HR_HazardBatch* batch, double input, const double* timestamps_diffs, const double* cumulative_hazards_diffs, int diffs_count, double bandwidth) {
+    if (batch->count == batch->capacity) {
+        reserve_hazard_batch(batch, batch->count + 1);
+    }
+    int query = batch->count++;
+    batch->inputs[query] = input;
+    batch->timestamps_diffs[query] = timestamps_diffs;
+    batch->cumulative_hazards_diffs[query] = cumulative_hazards_diffs;
+    batch->diffs_counts[query] = diffs_count;
+    batch->bandwidths[query] = bandwidth;
+    return query;
+}
+
+// Branchless std::lower_bound, the searches of a batch are independent so their loads overlap
+static int hazard_lower_bound(const double* timestamps_diffs, int diffs_count, double value) {
+    if (diffs_count == 0) {
+        return 0;
+    }
+    const double* base = timestamps_diffs;
+    int count = diffs_count;
+    while (count > 1) {
+        int half = count / 2;
+        base = base[half] < value ? base + half : base;
+        count -= half;
+    }
+    return (base - timestamps_diffs) + (*base < value);
+}
+
+void calculate_hazards(HR_HazardBatch* batch) {
+    for (int i = 0; i < batch->count; i++) {
+        double bandwidth = batch->bandwidths[i];
+        if (!(bandwidth > 0)) {
+            // degenerate bandwidths keep whatever the reference makes of them
+            batch->hazards[i] = calculate_hazard(
+                batch->inputs[i],
+                const_cast<double*>(batch->timestamps_diffs[i]),
+                const_cast<double*>(batch->cumulative_hazards_diffs[i]),
+                batch->diffs_counts[i],
+                bandwidth
+            );
+            continue;
+        }
+
+        int first = hazard_lower_bound(batch->timestamps_diffs[i], batch->diffs_counts[i], batch->inputs[i] - bandwidth);
+        // a handful of intervals does not fill a vector
+        HR_HazardScanKernel kernel = batch->diffs_counts[i] - first < HAZARD_SIMD_MINIMUM_COUNT ? hazard_scan_scalar : hazard_scan_kernel;
+        batch->hazards[i] = kernel(
+            batch->inputs[i],
+            batch->timestamps_diffs[i],
+            batch->cumulative_hazards_diffs[i],
+            first,
+            batch->diffs_counts[i],
+            bandwidth
+        );
+    }
+}
+
+// Grid points of the curve, 0 when the kernel is degenerate or the grid does not fit in max_points
+// and hazards have to be computed exactly
+int hazard_curve_points(const double* timestamps_diffs, int diffs_count, double bandwidth, double max_error, int max_points) {
+    // the first interval is the 0 the fitter prepends, its hazard is 0; without a positive error
+    // bound no grid is fine enough and the hazards stay exact
+    if (diffs_count <= 1 || !(bandwidth > 0) || !std::isfinite(bandwidth) || !(max_error > 0)) {
+        return 0;
+    }
+    double range = timestamps_diffs[diffs_count - 1] - timestamps_diffs[1] + 2 * bandwidth;
+    double points = std::ceil(range / (max_error * bandwidth)) + 1;
+    return points <= max_points ? static_cast<int>(points) : 0;
+}
+
+void build_hazard_curve(
+    HR_HazardCurve* curve,
+    HR_HazardBatch* batch,
+    const double* timestamps_diffs,
+    const double* cumulative_hazards_diffs,
+    int diffs_count,
+    double bandwidth,
+    int points
+) {
+    curve->count = points;
+    if (points == 0) {
+        return;
+    }
+
+    curve->start = timestamps_diffs[1] - bandwidth;
+    double range = timestamps_diffs[diffs_count - 1] + bandwidth - curve->start;
+    curve->scale = (points - 1) / range;
+
+    batch->count = 0;
+    reserve_hazard_batch(batch, points);
+    for (int i = 0; i < points; i++) {
+        add_hazard_query(batch, curve->start + i / curve->scale, timestamps_diffs, cumulative_hazards_diffs, diffs_count, bandwidth);
+    }
+    calculate_hazards(batch);
+    memcpy(curve->values, batch->hazards, sizeof(double) * points);
+}
+
+void destroy_hazard_batch(HR_HazardBatch* batch) {
+    free(batch->inputs);
+    free(batch->timestamps_diffs);
+    free(batch->cumulative_hazards_diffs);
+    free(batch->diffs_counts);
+    free(batch->bandwidths);
+    free(batch->hazards);
+    delete batch;
+}
@@ -2,26 +2,48 @@
 #define HR_CACHE_H
 
 #include "requests.h"
-#include <unordered_map>
+#include "lookup_table.h"
+#include "timing_wheel.h"
+#include "feature_value.h"
+#include <stdint.h>
+#include <vector>
+
+struct HR_Model;
+class HR_ObjectsMetadata;
 
 typedef enum {
     HOT = 0,
     COLD = 1
 } HR_CacheNodeMode;
 
-struct HR_CacheNode {
-    HR_CacheNodeMode mode;
+// Nodes live in fixed-size slabs and are linked by 32-bit slot indexes instead of pointers.
+// A slab is never moved once allocated, so HR_CacheNode* handed out by lookups stay valid
+// until the node is evicted.
+const int32_t HR_NULL_NODE = -1;
+const int HR_CACHE_SLAB_BITS = 12;
+const int HR_CACHE_SLAB_SIZE = 1 << HR_CACHE_SLAB_BITS;
+
+// 32 bytes, so two nodes share a cache line and a node never straddles two lines
+struct alignas(32) HR_CacheNode {
     int id;
     int size;
+    int32_t prev;
+    int32_t next;
     double last_seen;
-    struct HR_CacheNode* prev;
-    struct HR_CacheNode* next;
+    HR_CacheNodeMode mode;
+};
+
+struct HR_CacheNodePool {
+    std::vector<HR_CacheNode*> slabs;
+    int32_t free_list;                      // recycled slots, chained through next
+    int32_t nodes_count;                    // slots handed out from the slabs so far
 };
 
 struct HR_Cache {
-    HR_CacheNode* hot_cache;
-    HR_CacheNode* cold_cache;
-    std::unordered_map<int, HR_CacheNode*> lookup_table;
+    HR_CacheNodePool pool;
+    int32_t hot_cache;
+    int32_t cold_cache;
+    HR_LookupTable* lookup_table;           // object id -> node slot
     long long capacity;
     long long current_size;
     long long current_hot_size;
@@ -29,6 +51,22 @@ struct HR_Cache {
     double hot_lower_bound;
     double cold_lower_bound;
     bool evict_hot_for_cold;
+    // Latest last_seen given to a node; nodes are stamped no earlier, so that both lists stay sorted
+    // by last_seen even when requests are replayed out of order
+    double latest_seen;
+    // Cold node after which the next stale hot node is demoted, every node up to it is no newer;
+    // HR_NULL_NODE to insert from the cold head
+    int32_t demotion_cursor;
+    // Next nodes to rescore in each list, HR_NULL_NODE to start from the head
+    int32_t cold_rescore_cursor;
+    int32_t hot_rescore_cursor;
+    std::vector<int32_t> rescore_nodes;
+    std::vector<HR_FeatureValue> rescore_features;
+    std::vector<double> rescore_probabilities;
+    // Entries predicted with probability p expire max_ttl * p after that request, in trace time.
+    // The wheel is keyed by node slot; both are unset when entries never expire.
+    double max_ttl;
+    HR_TimingWheel* expirations;
 };
 
 struct HR_LookupAdmitResult {
@@ -40,13 +78,33 @@ struct HR_LookupAdmitResult {
     int cold_evictions_bytes;
 };
 
-HR_Cache* create_lru_cache(long long capacity, double hot_lower_bound, double cold_lower_bound, bool evict_hot_for_cold);
+struct HR_CleanupResult {
+    int rescored_count;
+    int evictions_count;
+    long long evictions_bytes;
+    int demotions_count;
+};
+
+inline HR_CacheNode* get_node(HR_Cache* cache, int32_t index) {
+    return &cache->pool.slabs[index >> HR_CACHE_SLAB_BITS][index & (HR_CACHE_SLAB_SIZE - 1)];
+}
+
+HR_Cache* create_lru_cache(long long capacity, double hot_lower_bound, double cold_lower_bound, bool evict_hot_for_cold, double max_ttl=0);
 HR_CacheNode* lookup_without_move(HR_Cache* cache, int request_id);
 HR_CacheNode* lookup(HR_Cache* cache, HR_Request* request);
 HR_LookupAdmitResult lookup_and_admit(HR_Cache* cache, HR_Request* request);
-int cleanup_cache(HR_Cache* cache, double last_seen_threshold);
-int cleanup_expired_hot(HR_Cache* cache, double last_seen_threshold);
+void schedule_expiry(HR_Cache* cache, HR_Request* request);
+int expire_cache(HR_Cache* cache, double timestamp, long long* expired_bytes);
+// Predicts again, in one batch, the next budget entries of the cold list (half of them from the hot
+// list with_hot) from the latest features of their objects, going round the lists across calls.
+// Entries below cold_lower_bound are evicted and hot ones below hot_lower_bound are demoted to their
+// place by last_seen in the cold list, walking at most budget cold nodes to find it
+HR_CleanupResult cleanup_cache(HR_Cache* cache, HR_Model* model, HR_ObjectsMetadata* objects_metadata, int budget, bool with_hot);
+// Moves hot nodes last seen at or before the threshold to their place by last_seen in the cold list.
+// Stops at the first hot node seen after the threshold, which relies on the hot list being sorted by
+// last_seen. Walks at most max_steps nodes and resumes there on the next call; returns how many were demoted
+int demote_stale_hot(HR_Cache* cache, double last_seen_threshold, int max_steps);
 
 void destroy_lru_cache(HR_Cache* cache);
 
-#endif // HR_CACHE_H
\ No newline at end of file
+#endif // HR_CACHE_H
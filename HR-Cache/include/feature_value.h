@@ -0,0 +1,53 @@
+#ifndef HR_FEATURE_VALUE_H
+#define HR_FEATURE_VALUE_H
+
+#include <stdint.h>
+#include <cmath>
+#include <algorithm>
+
+// Features are held as HR_FeatureValue in the request window and the objects metadata. The type is
+// chosen at build time with HR_FEATURE_VALUE_DOUBLE (the default), HR_FEATURE_VALUE_FLOAT or
+// HR_FEATURE_VALUE_LOG16. LOG16 stores a 16-bit code on a log2 scale, 0 for zero, that is within
+// 0.07% of the value from 2^-24 up to 2^40. The model learns on the codes themselves: they are
+// monotonic in the values and trees only compare, so the splits do not change beyond the rounding.
+#if defined(HR_FEATURE_VALUE_LOG16)
+typedef uint16_t HR_FeatureValue;
+const char* const HR_FEATURE_VALUE_NAME = "log16";
+const int HR_FEATURE_LOG16_MINIMUM_EXPONENT = -24;
+const int HR_FEATURE_LOG16_STEPS_PER_OCTAVE = 1023;
+const int HR_FEATURE_LOG16_MAXIMUM_CODE = 65535;
+
+inline HR_FeatureValue encode_feature(double value) {
+    // negative values and NaNs too
+    if (!(value > 0)) {
+        return 0;
+    }
+    double code = std::round((std::log2(value) - HR_FEATURE_LOG16_MINIMUM_EXPONENT) * HR_FEATURE_LOG16_STEPS_PER_OCTAVE) + 1;
+    return static_cast<HR_FeatureValue>(std::min(std::max(code, 1.0), static_cast<double>(HR_FEATURE_LOG16_MAXIMUM_CODE)));
+}
+
+inline double decode_feature(HR_FeatureValue code) {
+    if (code == 0) {
+        return 0;
+    }
+    return std::exp2(static_cast<double>(code - 1) / HR_FEATURE_LOG16_STEPS_PER_OCTAVE + HR_FEATURE_LOG16_MINIMUM_EXPONENT);
+}
+#else
+#if defined(HR_FEATURE_VALUE_FLOAT)
+typedef float HR_FeatureValue;
+const char* const HR_FEATURE_VALUE_NAME = "float";
+#else
+typedef double HR_FeatureValue;
+const char* const HR_FEATURE_VALUE_NAME = "double";
+#endif
+
+inline HR_FeatureValue encode_feature(double value) {
+    return static_cast<HR_FeatureValue>(value);
+}
+
+inline double decode_feature(HR_FeatureValue value) {
+    return value;
+}
+#endif
+
+#endif // HR_FEATURE_VALUE_H
@@ -0,0 +1,43 @@
+#ifndef HR_FOREST_H
+#define HR_FOREST_H
+
+#include <stdint.h>
+#include <string>
+#include "feature_value.h"
+
+// A trained binary LightGBM booster flattened for inference, every tree's nodes contiguous in one array.
+// Leaves are nodes too, that send every value back to themselves, so a row reaches its leaf after
+// exactly the depth of the tree and rows can walk a tree in lockstep without data dependent exits.
+// Decisions follow LightGBM's NumericalDecision and scores are summed in tree order, so probabilities
+// match the booster's exactly. Boosters with categorical splits, linear trees or another objective
+// are not flattened.
+const uint8_t HR_FOREST_MISSING_NONE = 0;
+const uint8_t HR_FOREST_MISSING_ZERO = 1;
+const uint8_t HR_FOREST_MISSING_NAN = 2;
+
+struct HR_ForestNode {
+    double threshold;                       // +infinity for leaves
+    int32_t feature;
+    int32_t children[2];                    // left, right
+    uint8_t missing_type;
+    uint8_t default_left;
+};
+
+struct HR_Forest {
+    int trees_count;
+    int32_t* roots;
+    int* depths;                            // decisions from the root to the deepest leaf
+    HR_ForestNode* nodes;
+    double* leaf_values;                    // by node, 0 for split nodes
+    int nodes_count;
+    int features_length;
+    double sigmoid;
+};
+
+// Returns NULL when the model cannot be flattened
+HR_Forest* create_forest(const std::string& model, int features_length);
+// features is a rows_count x features_length row-major matrix
+void predict_forest(const HR_Forest* forest, const HR_FeatureValue* features, int rows_count, double* probabilities);
+void destroy_forest(HR_Forest* forest);
+
+#endif // HR_FOREST_H
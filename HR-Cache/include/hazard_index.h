@@ -0,0 +1,53 @@
+#ifndef HR_HAZARD_INDEX_H
+#define HR_HAZARD_INDEX_H
+
+#include <stdint.h>
+#include <vector>
+#include <queue>
+
+// Answers "total size of the objects whose hazard is at least h" in O(log buckets).
+// Hazards are kept in log scale buckets, HR_HAZARD_INDEX_SUB_BUCKETS per power of two, with a
+// fenwick tree of the object sizes over the buckets. Bucket 0 holds the objects whose hazard is 0.
+// A query counts the whole bucket of h, so an object whose indexed hazard is exact is only
+// misjudged when it is within a relative 1 / HR_HAZARD_INDEX_SUB_BUCKETS below h.
+//
+// Hazards drift as time passes; the index only keeps a refresh schedule per object and the owner
+// recomputes the hazards that are due before querying. In between refreshes a bucket can be
+// arbitrarily stale, so the error of a query is not bounded: it is only measured, at about 0.2%
+// of the labels disagreeing with exact hazards on Zipf traces.
+const int HR_HAZARD_INDEX_SUB_BUCKETS = 16;
+const int HR_HAZARD_INDEX_MIN_EXPONENT = -64;
+const int HR_HAZARD_INDEX_MAX_EXPONENT = 64;
+const int HR_HAZARD_INDEX_BUCKETS = 1 + (HR_HAZARD_INDEX_MAX_EXPONENT - HR_HAZARD_INDEX_MIN_EXPONENT) * HR_HAZARD_INDEX_SUB_BUCKETS;
+const int HR_HAZARD_INDEX_ABSENT = -1;
+
+struct HR_HazardRefresh {
+    double time;
+    int object;
+    uint32_t version;                       // stale when the object was rescheduled since
+
+    bool operator>(const HR_HazardRefresh& other) const {
+        return time > other.time;
+    }
+};
+
+struct HR_HazardIndex {
+    long long* tree;                        // fenwick tree of sizes, 1-based over the buckets
+    long long total_size;
+    int objects_count;
+    int* buckets;                           // bucket of each object, HR_HAZARD_INDEX_ABSENT if not indexed
+    int* sizes;
+    uint32_t* versions;
+    std::priority_queue<HR_HazardRefresh, std::vector<HR_HazardRefresh>, std::greater<HR_HazardRefresh>> refreshes;
+};
+
+HR_HazardIndex* create_hazard_index(int objects_count);
+int hazard_bucket(double hazard);
+void hazard_index_set(HR_HazardIndex* index, int object, int size, double hazard);
+long long hazard_index_size_at_least(const HR_HazardIndex* index, double hazard);
+void hazard_index_schedule(HR_HazardIndex* index, int object, double time);
+bool hazard_index_next_due(HR_HazardIndex* index, double time, int* object);
+
+void destroy_hazard_index(HR_HazardIndex* index);
+
+#endif // HR_HAZARD_INDEX_H
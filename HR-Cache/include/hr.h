@@ -4,10 +4,26 @@
 #include "requests.h"
 #include "cache.h"
 #include "model.h"
+#include "predictor.h"
 #include <unordered_map>
 #include <optional>
 #include <thread>
 #include <fstream>
+#include <atomic>
+#include <ctime>
+
+const long long CACHE_SIZE = 3941722;
+
+typedef enum {
+    RETRAIN_SYNC = 0,                       // the request that completes a window waits for its model
+    RETRAIN_ASYNC = 1,                      // train in the background, a completed window waits for the previous training
+    RETRAIN_SKIP = 2                        // train in the background, windows completed while training are dropped
+} HR_RetrainMode;
+
+typedef enum {
+    PREDICT_SYNC = 0,                       // every concurrency requests, misses are admitted as cold until then
+    PREDICT_PIPELINE = 1                    // on a predictor thread, requests are admitted once scored
+} HR_PredictMode;
 
 struct HRCache {
     std::string key;
@@ -18,12 +34,16 @@ struct HRCache {
     HR_Cache* lru_cache;
     HR_RequestWindow* request_window;
     HR_Model* model;
+    bool owns_model;                        // false when the model is shared between shards
+    int labeling_threads;                   // threads preparing and labeling a window, 0 for one per core
     double learning_rate;
     double hazard_bandwidth;
     bool hazard_discrete;
+    double hazard_max_error;                // of the hazard curves, relative to the peak hazard
     bool future_labeling;
     bool one_time_training;
     int report_interval;
+    bool log_console;                       // print the interval reports to stdout
     bool log_file;
     bool log_requests;
     int requests_count;
@@ -36,6 +56,28 @@ struct HRCache {
     double analytics_hot_evicted_reqs;
     double analytics_cold_evicted_bytes;
     double analytics_cold_evicted_reqs;
+    double cumulative_expired_bytes;        // removed by their time to live, in MB like the evictions
+    double cumulative_expired_reqs;
+    double analytics_expired_bytes;
+    double analytics_expired_reqs;
+    double cumulative_demoted_reqs;         // stale hot entries moved to cold
+    double hot_max_idle;                    // trace time after which an untouched hot entry is demoted, 0 to never
+    int demotion_steps;                     // cold list nodes walked per request at most while demoting
+    int rescore_budget;                     // resident entries predicted again per sync, 0 to never
+    bool rescore_hot;
+    HR_PredictMode predict_mode;
+    HR_Predictor* predictor;                // NULL unless predict_mode is PREDICT_PIPELINE
+    // Stage histograms of the request and the training threads, the predictor keeps its own.
+    // Reports print the difference between their sums at this report and at the previous one
+    HR_LatencyHistograms* request_latencies;
+    HR_LatencyHistograms* training_latencies;
+    HR_LatencySnapshot* latencies_snapshot;
+    HR_LatencySnapshot* previous_latencies_snapshot;
+    std::clock_t reported_clock;            // process CPU time at the previous report
+    long long cumulative_rescored_reqs;
+    double cumulative_rescore_evicted_reqs;
+    double cumulative_rescore_evicted_bytes;
+    double cumulative_rescore_demoted_reqs;
 
     bool start_counting_cumulative;
     int without_training_count;
@@ -53,10 +95,14 @@ struct HRCache {
     long long analytics_bytes_hit;
     long long analytics_round;
 
+    HR_RetrainMode retrain_mode;
+    std::atomic<bool> training;
+    int skipped_windows;
     std::thread model_thread;
     std::ofstream requests_file;
     std::ofstream analytics_file;
-    HR_Request* last_processed_request;
+    std::ostream* analytics_stream;         // where the analytics rows go, NULL when not logging them
+    int last_processed_request;             // index in request_window, -1 before the first sync
 };
 
 HRCache* create_hr(
@@ -80,10 +126,32 @@ HRCache* create_hr(
     std::optional<int> report_interval=std::nullopt,
     std::optional<bool> log_file=std::nullopt,
     std::optional<bool> log_requests=std::nullopt,
-    std::optional<std::string> log_file_name=std::nullopt
+    std::optional<std::string> log_file_name=std::nullopt,
+    std::optional<HR_RetrainMode> retrain_mode=std::nullopt,
+    std::optional<int> incremental_boost_rounds=std::nullopt,
+    std::optional<int> full_rebuild_interval=std::nullopt,
+    std::optional<double> max_ttl=std::nullopt,
+    std::optional<int> rescore_budget=std::nullopt,
+    std::optional<bool> rescore_hot=std::nullopt,
+    std::optional<HR_PredictMode> predict_mode=std::nullopt,
+    std::optional<double> predict_latency_target=std::nullopt,
+    std::optional<double> hazard_max_error=std::nullopt,
+    std::optional<double> hot_max_idle=std::nullopt,
+    std::optional<int> demotion_steps=std::nullopt,
+    HR_Model* shared_model=NULL
 );
 void log_args(HRCache* hr);
 void log_analytics(HRCache* hr, bool log_without_training);
+void write_analytics_header(std::ostream& out);
+void write_analytics_row(
+    std::ostream& out,
+    HRCache* hr,
+    double miss_bytes_percentage,
+    double miss_percentage,
+    double cumulative_miss_bytes_percentage,
+    double cumulative_miss_percentage
+);
+// Returns whether the request was admitted right away; scored requests of the pipeline are admitted later
 bool new_request(HRCache* hr, double timestamp, int object_id, int size);
 
 void destroy_hr(HRCache* hr);
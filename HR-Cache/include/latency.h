@@ -0,0 +1,95 @@
+#ifndef HR_LATENCY_H
+#define HR_LATENCY_H
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// Log-linear (HDR style) histograms of durations in timestamp counter ticks. Values below
+// HR_HISTOGRAM_SUB_BUCKETS are counted exactly; above, every power of two is split into
+// HR_HISTOGRAM_SUB_BUCKETS buckets, so a bucket is within 1/16 of the values it holds.
+// A histogram has a single writer that bumps its counters with relaxed loads and stores, and any
+// thread may sum it into a snapshot at the same time; a report is the difference of two snapshots.
+const int HR_HISTOGRAM_SUB_BITS = 4;
+const int HR_HISTOGRAM_SUB_BUCKETS = 1 << HR_HISTOGRAM_SUB_BITS;
+const int HR_HISTOGRAM_MAGNITUDES = 48;     // durations up to 2^48 ticks
+const int HR_HISTOGRAM_BUCKETS = (HR_HISTOGRAM_MAGNITUDES - HR_HISTOGRAM_SUB_BITS + 1) * HR_HISTOGRAM_SUB_BUCKETS;
+
+typedef enum {
+    HR_STAGE_REQUEST = 0,                   // a whole new_request
+    HR_STAGE_ADD_REQUEST = 1,
+    HR_STAGE_LOOKUP_ADMIT = 2,
+    HR_STAGE_PREDICT = 3,                   // a sync of the request window or a batch of the predictor
+    HR_STAGE_SAMPLE_OBJECTS = 4,
+    HR_STAGE_PREPARE_OBJECTS = 5,
+    HR_STAGE_PREPARE_REQUESTS = 6,
+    HR_STAGE_TRAIN = 7,
+    HR_STAGES_COUNT = 8
+} HR_Stage;
+
+struct HR_Histogram {
+    std::atomic<uint64_t> counts[HR_HISTOGRAM_BUCKETS];
+};
+
+// The histograms of one recording thread
+struct HR_LatencyHistograms {
+    HR_Histogram stages[HR_STAGES_COUNT];
+};
+
+struct HR_LatencySnapshot {
+    uint64_t counts[HR_STAGES_COUNT][HR_HISTOGRAM_BUCKETS];
+};
+
+inline uint64_t latency_ticks() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#elif defined(__aarch64__)
+    uint64_t ticks;
+    asm volatile("mrs %0, cntvct_el0" : "=r"(ticks));
+    return ticks;
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()
+    ).count();
+#endif
+}
+
+inline int histogram_bucket(uint64_t value) {
+    if (value < static_cast<uint64_t>(HR_HISTOGRAM_SUB_BUCKETS)) {
+        return static_cast<int>(value);
+    }
+    int magnitude = 63 - __builtin_clzll(value);
+    if (magnitude >= HR_HISTOGRAM_MAGNITUDES) {
+        return HR_HISTOGRAM_BUCKETS - 1;
+    }
+    int shift = magnitude - HR_HISTOGRAM_SUB_BITS;
+    return (shift + 1) * HR_HISTOGRAM_SUB_BUCKETS + static_cast<int>(value >> shift) - HR_HISTOGRAM_SUB_BUCKETS;
+}
+
+inline void histogram_record(HR_Histogram* histogram, uint64_t value) {
+    std::atomic<uint64_t>* count = &histogram->counts[histogram_bucket(value)];
+    count->store(count->load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+// Records the time since start and returns now, so consecutive stages can share one reading
+inline uint64_t record_stage(HR_LatencyHistograms* latencies, HR_Stage stage, uint64_t start) {
+    uint64_t now = latency_ticks();
+    histogram_record(&latencies->stages[stage], now - start);
+    return now;
+}
+
+HR_LatencyHistograms* create_latency_histograms();
+double latency_ticks_per_nanosecond();
+double ticks_to_nanoseconds(uint64_t ticks);
+void merge_latencies(const HR_LatencyHistograms* latencies, HR_LatencySnapshot* snapshot);
+// The smallest value, in ticks, at or above the given fraction of the samples
+uint64_t histogram_percentile(const uint64_t* counts, double fraction);
+// Prints p50/p90/p99/p99.9 of every stage recorded since previous, or since the start without it
+void log_latencies(const HR_LatencySnapshot* current, const HR_LatencySnapshot* previous);
+
+void destroy_latency_histograms(HR_LatencyHistograms* latencies);
+
+#endif // HR_LATENCY_H
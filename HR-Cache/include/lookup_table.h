@@ -0,0 +1,46 @@
+#ifndef HR_LOOKUP_TABLE_H
+#define HR_LOOKUP_TABLE_H
+
+#include <stdint.h>
+
+// Open-addressing int -> int32 map with linear probing and backward-shift deletion,
+// so erasing leaves no tombstones and the table only ever holds live entries.
+// Values must be non-negative; a negative value marks an empty slot.
+const int32_t HR_LOOKUP_TABLE_EMPTY = -1;
+
+struct HR_LookupTableSlot {
+    int key;
+    int32_t value;
+};
+
+struct HR_LookupTable {
+    HR_LookupTableSlot* slots;
+    uint32_t mask;                          // slots count - 1, slots count is a power of two
+    int shift;                              // 32 - log2(slots count), for fibonacci hashing
+    int count;
+    int min_slots_count;
+};
+
+inline uint32_t lookup_table_home(const HR_LookupTable* table, int key) {
+    return (static_cast<uint32_t>(key) * 2654435769u) >> table->shift;
+}
+
+inline int32_t lookup_table_find(const HR_LookupTable* table, int key) {
+    uint32_t i = lookup_table_home(table, key);
+    while (true) {
+        const HR_LookupTableSlot& slot = table->slots[i];
+        if (slot.value == HR_LOOKUP_TABLE_EMPTY || slot.key == key) {
+            return slot.value;
+        }
+        i = (i + 1) & table->mask;
+    }
+}
+
+HR_LookupTable* create_lookup_table(int expected_count);
+void lookup_table_insert(HR_LookupTable* table, int key, int32_t value);
+bool lookup_table_erase(HR_LookupTable* table, int key);
+long long lookup_table_memory(const HR_LookupTable* table);
+
+void destroy_lookup_table(HR_LookupTable* table);
+
+#endif // HR_LOOKUP_TABLE_H
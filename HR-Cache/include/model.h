@@ -2,30 +2,84 @@
 #define HR_MODEL_H
 
 #include "requests.h"
+#include "forest.h"
 #include <LightGBM/c_api.h>
 #include <thread>
 #include <mutex>
+#include <atomic>
+#include <random>
+#include <type_traits>
+
+// LightGBM reads float and double matrices only, so training rows are stored in the wider of the two
+// needed by HR_FeatureValue; log16 codes are exact in a float
+typedef std::conditional<sizeof(HR_FeatureValue) == sizeof(double), double, float>::type HR_TrainingValue;
+const int HR_TRAINING_VALUE_TYPE = sizeof(HR_TrainingValue) == sizeof(double) ? C_API_DTYPE_FLOAT64 : C_API_DTYPE_FLOAT32;
+
+// A trained booster with the dataset it was trained on. Once published a snapshot is immutable;
+// it is freed by the next publication after every reader that could still see it is gone.
+struct HR_ModelSnapshot {
+    DatasetHandle dataset_handle;
+    BoosterHandle booster_handle;
+    HR_Forest* forest;                      // the booster flattened for prediction, NULL to predict with LightGBM
+};
+
+struct alignas(64) HR_ModelReaders {
+    std::atomic<int> count;
+};
 
 struct HR_Model {
-    double **data;
-    int row_count;
+    // Training rows live in one row-major features matrix with a separate labels column, so that
+    // LightGBM reads them in place. Rows are appended until the store is full; from then on every
+    // new row replaces a random one.
+    HR_TrainingValue *features;
+    float *labels;
+    int row_count;                          // rows in use
     bool full;
+    std::mt19937 random;
     int features_length;
     int max_boost_round;
+    // Incremental training adds incremental_boost_round rounds fitted on the new window's rows to the
+    // current booster, starting from its raw scores. Every full_rebuild_interval trainings, or always
+    // when incremental_boost_round is 0, the booster is rebuilt from the whole store instead.
+    int incremental_boost_round;
+    int full_rebuild_interval;              // 0 to never rebuild once a booster exists
+    int trainings_since_rebuild;
+    int full_trainings;
+    int incremental_trainings;
+    double full_training_seconds;
+    double incremental_training_seconds;
     int max_train_set_count;
-    bool available;
-    std::mutex mtx;
-    DatasetHandle* dataset_handle;
-    BoosterHandle* booster_handle;
-    DatasetHandle* new_dataset_handle;
-    BoosterHandle* new_booster_handle;
+
+    // Training datasets are binned with the bin mappers of reference_dataset, built from a sample of
+    // the rows. The reference keeps DRIFT_BINS quantile bins per feature with their share of the sample;
+    // it is rebuilt once the population stability index of any feature exceeds drift_threshold.
+    DatasetHandle reference_dataset;
+    double* drift_edges;                    // features_length x (DRIFT_BINS - 1) bin boundaries
+    double* drift_proportions;              // features_length x DRIFT_BINS
+    double drift_threshold;
+    int reference_builds;
+    double dataset_seconds;                 // time spent building training datasets, references included
+
+    int threads;                            // LightGBM threads for training and prediction, 0 for its default
+    std::atomic<bool> available;
+    std::mutex mtx;                         // serializes training, never taken by readers
+
+    // RCU style publication: readers register in the current epoch's parity and read snapshot
+    // without locking; a publisher swaps snapshot, flips the epoch and waits for the readers
+    // of the previous parity to leave before freeing the old snapshot
+    std::atomic<HR_ModelSnapshot*> snapshot;
+    std::atomic<unsigned> epoch;
+    HR_ModelReaders readers[2];
 };
 
-HR_Model* create_hr_model(int cache_size, int features_length, int max_boost_round);
-void update_hr_model(HR_Model* model, HR_Request** requests, int requests_count, bool verbose);
-void train_hr_model(HR_Model* model, bool verbose=false);
-double predict_hr_label(HR_Model* model, double* features);
-void predict_requests(HR_Model* model, HR_Request** requests, int requests_count);
+HR_Model* create_hr_model(int cache_size, int features_length, int max_boost_round, int incremental_boost_round, int full_rebuild_interval);
+void update_hr_model(HR_Model* model, const HR_FeatureValue* request_features, const int* request_labels, const int* rows, int rows_count, bool verbose);
+void train_hr_model(HR_Model* model, HR_ModelSnapshot* snapshot, bool verbose=false);
+void continue_hr_model(HR_Model* model, HR_ModelSnapshot* snapshot, HR_ModelSnapshot* current, const HR_TrainingValue* features, int rows_count, bool verbose=false);
+HR_ModelSnapshot* acquire_model(HR_Model* model, int* reader_slot);
+void release_model(HR_Model* model, int reader_slot);
+double predict_hr_label(HR_Model* model, const HR_FeatureValue* features);
+void predict_requests(HR_Model* model, const HR_FeatureValue* features, int requests_count, double* probabilities);
 
 void destroy_hr_model(HR_Model* model);
 
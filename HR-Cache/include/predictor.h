@@ -0,0 +1,59 @@
+#ifndef HR_PREDICTOR_H
+#define HR_PREDICTOR_H
+
+#include "requests.h"
+#include "model.h"
+#include "latency.h"
+#include <atomic>
+#include <thread>
+
+// Prediction stage between new_request and the cache. The request thread submits requests with a
+// copy of their features into a bounded ring, a predictor thread scores them in micro-batches and
+// the request thread takes the scored ones back in order to admit them. The ring is allocated once
+// and a slot goes submitted -> scored -> applied by advancing three counters, each written by one
+// thread only. The batch size doubles while a batch takes less than half the latency target and is
+// halved when a batch takes longer than it.
+const int HR_PREDICTOR_CAPACITY = 1024;     // power of two
+const int HR_PREDICTOR_MAX_BATCH = 512;
+const int HR_PREDICTOR_BATCH_BUCKETS = 10;  // batch sizes 1, 2-3, 4-7, ... 512
+
+// Batches by size bucket; latencies are from submission to score
+struct HR_PredictorStats {
+    long long batches;
+    long long requests;
+    uint64_t predict_ticks;
+    HR_Histogram latencies;
+};
+
+struct HR_Predictor {
+    HR_Model* model;
+    int features_length;
+    double latency_target;                  // seconds per batch
+    int batch_size;                         // predictor thread only
+    // by slot
+    HR_Request* requests;
+    HR_FeatureValue* features;
+    double* probabilities;
+    uint64_t* submit_times;                 // latency ticks
+    std::atomic<long long> submitted;       // written by the request thread
+    std::atomic<long long> scored;          // written by the predictor thread
+    long long applied;                      // request thread only
+    std::atomic<bool> stopping;
+    // written by the predictor thread before it publishes the batch, read after predictor_flush
+    HR_PredictorStats stats[HR_PREDICTOR_BATCH_BUCKETS];
+    HR_LatencyHistograms* latencies;        // written by the predictor thread
+    std::thread thread;
+};
+
+HR_Predictor* create_predictor(HR_Model* model, int features_length, double latency_target);
+// false when the ring is full, the caller has to apply scored requests first
+bool predictor_submit(HR_Predictor* predictor, const HR_Request* request, const HR_FeatureValue* features);
+// Takes the oldest scored request, with its admit probability, false when it is not scored yet
+bool predictor_next_scored(HR_Predictor* predictor, HR_Request* request);
+// Waits until every submitted request is scored
+void predictor_flush(HR_Predictor* predictor);
+void log_predictor_stats(HR_Predictor* predictor);
+
+void destroy_predictor(HR_Predictor* predictor);
+
+#endif // HR_PREDICTOR_H
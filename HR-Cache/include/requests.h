@@ -2,6 +2,10 @@
 #define HR_REQUESTS_H
 
 #include "metadata.h"
+#include "lookup_table.h"
+#include "utils.h"
+#include "latency.h"
+#include <stdint.h>
 #include <unordered_map>
 #include <set>
 
@@ -11,43 +15,56 @@ enum HR_FEATURE {
     FEAT_DECAYED_FREQUENCY = 2
 };
 
+const int32_t HR_NULL_REQUEST = -1;
+
+// A single request as seen by the cache, copied out of the window columns
 struct HR_Request {
     int object_id;
     double timestamp;
     int size;
     double admit_probability;
-    int label;
-    double *features;
-    HR_Request *next;
-    HR_Request *prev;
-    HR_Request *next_in_time;
-    HR_Request *prev_in_time;
 };
 
 struct Object {
     int idx;
     int id;
     int size;
-    HR_Request *request;
+    int32_t first_request;                  // index of the first request in the window
+    int32_t last_request;                   // index of the latest request in the window
     int requests_count;                     // number of requests
-    
+
     bool sampled;                           // whether the object is sampled
-    double *timestamps;                     // timestamps of the requests in the window
     double *timestamps_diffs;               // intervals between timestamps
     double *cumulative_hazards_diffs;       // cumulative hazards for each interval
     double hazard_bandwidth;                // bandwidth for the hazard estimation
     int diffs_count;                        // number of intervals
-    std::unordered_map<double, double> hazards;  // hazards for each timestamp diff
+    HR_HazardCurve hazard_curve;            // the fitted hazard, tabulated for constant time lookups
 };
 
+// Requests are stored column by column in arrival order, so a request is just an index.
+// All columns, the objects and the samples arena are flat allocations, which lets the whole
+// window be released with a handful of frees regardless of its size.
 struct HR_RequestWindow {
     int *size;
     long long cache_size;
     int requests_count;
-    HR_Request *request;
+    int requests_capacity;
+    double *timestamps;
+    int *object_ids;
+    int *objects_idx;                       // index of the request's object in objects
+    int *sizes;
+    int *labels;
+    double *admit_probabilities;
+    int32_t *next_requests;                 // next request of the same object, HR_NULL_REQUEST at the end
+    HR_FeatureValue *request_features;      // requests_capacity x features_length, row major
+
     int objects_count;
+    int objects_capacity;
     long long objects_size;
-    std::unordered_map<int, Object*> objects;
+    Object *objects;
+    HR_LookupTable* objects_table;          // object id -> index in objects
+    double *samples_arena;                  // diffs and hazards of the sampled objects
+    double *curves_arena;                   // hazard curves of the sampled objects
     HR_ObjectsMetadata* objects_metadata;
 
     double avg_req_size;
@@ -56,9 +73,22 @@ struct HR_RequestWindow {
     int custom_features_count;
     int features_length;
     std::unordered_map<HR_FEATURE, bool> features;
-    HR_Request **sampled_requests;
+    int *sampled_requests;                  // indexes of the sampled requests in arrival order
 };
 
+inline HR_FeatureValue* get_request_features(HR_RequestWindow* request_window, int request) {
+    return request_window->request_features + static_cast<long long>(request) * request_window->features_length;
+}
+
+inline HR_Request get_request(HR_RequestWindow* request_window, int request) {
+    HR_Request result;
+    result.object_id = request_window->object_ids[request];
+    result.timestamp = request_window->timestamps[request];
+    result.size = request_window->sizes[request];
+    result.admit_probability = request_window->admit_probabilities[request];
+    return result;
+}
+
 HR_RequestWindow* create_request_window(
     int *size,
     long long cache_size,
@@ -68,10 +98,12 @@ HR_RequestWindow* create_request_window(
 );
 void update_default_features(HR_RequestWindow* request_window);
 Object* get_object(HR_RequestWindow* request_window, const int object_id, int size);
-HR_Request* add_request(HR_RequestWindow* request_window, int object_id, double timestamp, int size);
+int add_request(HR_RequestWindow* request_window, int object_id, double timestamp, int size);
 bool window_is_ready(HR_RequestWindow* request_window, double weight=1);
-void prepare_request_window(HR_RequestWindow* request_window, int max_requests_count, double bandwidth, bool discrete, bool future_labeling, bool verbose=false);
+// Hazard curves are interpolated within hazard_max_error of the peak hazard, see HR_HazardCurve.
+// Runs on threads threads, 0 for one per core. Records the duration of each phase in latencies, when given
+void prepare_request_window(HR_RequestWindow* request_window, int max_requests_count, double bandwidth, bool discrete, double hazard_max_error, bool future_labeling, int threads, bool verbose=false, HR_LatencyHistograms* latencies=NULL);
 
 void destroy_request_window(HR_RequestWindow* request_window);
 
-#endif // HR_REQUESTS_H
\ No newline at end of file
+#endif // HR_REQUESTS_H
@@ -0,0 +1,26 @@
+#ifndef HR_SHARDS_H
+#define HR_SHARDS_H
+
+#include "hr.h"
+#include <functional>
+#include <mutex>
+
+// Object ids are hashed to independent HRCache shards, each with its own cache partition,
+// request window and objects metadata. All shards share one model, which the sharded cache owns.
+// Each shard is guarded by its own lock, so callers on different shards never contend.
+struct HR_ShardedCache {
+    int shards_count;
+    HRCache** shards;
+    std::mutex* locks;
+    HR_Model* model;
+};
+
+// create_shard builds shard i; it must pass shared_model on to create_hr (NULL for the first shard,
+// whose model then becomes the shared one) and give the shard its part of the cache size.
+HR_ShardedCache* create_sharded_hr(int shards_count, std::function<HRCache*(int shard, HR_Model* shared_model)> create_shard);
+int get_shard(HR_ShardedCache* sharded_hr, int object_id);
+bool sharded_new_request(HR_ShardedCache* sharded_hr, double timestamp, int object_id, int size);
+
+void destroy_sharded_hr(HR_ShardedCache* sharded_hr);
+
+#endif // HR_SHARDS_H
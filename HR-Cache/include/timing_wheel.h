@@ -0,0 +1,41 @@
+#ifndef HR_TIMING_WHEEL_H
+#define HR_TIMING_WHEEL_H
+
+#include <stdint.h>
+
+// Hierarchical timing wheel over trace time, in ticks of a fixed length. Level l has
+// HR_TIMING_WHEEL_SLOTS buckets of HR_TIMING_WHEEL_SLOTS^l ticks; a timer goes to the lowest level
+// whose span covers its distance and is moved down a level when the wheel reaches its bucket, so
+// scheduling and cancelling are O(1) and advancing is amortized O(1) per timer and level.
+// Timers are small integers chosen by the owner, linked through per-timer columns. Timers farther
+// than the wheel span wait in the top level and are placed again when it comes around.
+const int HR_TIMING_WHEEL_BITS = 6;
+const int HR_TIMING_WHEEL_SLOTS = 1 << HR_TIMING_WHEEL_BITS;
+const int HR_TIMING_WHEEL_LEVELS = 4;
+const int32_t HR_TIMING_WHEEL_NONE = -1;
+
+struct HR_TimingWheel {
+    double tick;                            // trace time per tick
+    long long current;                      // next tick to process, every earlier one is done
+    bool started;
+    int32_t* heads;                         // levels x slots buckets, then the due list
+    int levels_counts[HR_TIMING_WHEEL_LEVELS];
+    int count;                              // timers scheduled, due ones included
+    // by timer
+    int32_t* next;
+    int32_t* prev;
+    int32_t* buckets;                       // HR_TIMING_WHEEL_NONE when not scheduled
+    long long* expiries;
+    int capacity;
+};
+
+HR_TimingWheel* create_timing_wheel(double tick);
+// Replaces the pending expiry of the timer
+void timing_wheel_schedule(HR_TimingWheel* wheel, int32_t timer, double time);
+void timing_wheel_cancel(HR_TimingWheel* wheel, int32_t timer);
+// Pops the next timer that expired by time; it is no longer scheduled
+bool timing_wheel_next_due(HR_TimingWheel* wheel, double time, int32_t* timer);
+
+void destroy_timing_wheel(HR_TimingWheel* wheel);
+
+#endif // HR_TIMING_WHEEL_H
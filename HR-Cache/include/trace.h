@@ -0,0 +1,93 @@
+#ifndef HR_TRACE_H
+#define HR_TRACE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+
+// Binary trace: a header followed by fixed-width records, in host byte order.
+// Plain records hold the timestamp as a double. Delta records hold the distance to the previous
+// timestamp as a uint32, which only works for integral, non-decreasing timestamps; the converter
+// checks that every timestamp round-trips exactly before it picks them.
+const uint32_t HR_TRACE_MAGIC = 0x43525448;  // "HTRC"
+const uint16_t HR_TRACE_VERSION = 1;
+const uint16_t HR_TRACE_DELTA = 1 << 0;
+
+struct HR_TraceHeader {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t flags;
+    uint32_t record_size;
+    uint32_t reserved;
+    int64_t requests_count;
+    double base_timestamp;                  // first timestamp, delta records start from it
+};
+
+struct HR_TraceRecord {
+    double timestamp;
+    int32_t object_id;
+    int32_t size;
+};
+
+struct HR_TraceDeltaRecord {
+    uint32_t timestamp_delta;
+    int32_t object_id;
+    int32_t size;
+};
+
+static_assert(sizeof(HR_TraceHeader) == 32, "trace header layout is part of the file format");
+static_assert(sizeof(HR_TraceRecord) == 16, "trace record layout is part of the file format");
+static_assert(sizeof(HR_TraceDeltaRecord) == 12, "trace record layout is part of the file format");
+
+struct HR_TraceRequest {
+    double timestamp;
+    int object_id;
+    int size;
+};
+
+// A binary trace is mapped read-only; a text trace is parsed once into plain records in memory,
+// so both are replayed through the same cursor.
+struct HR_Trace {
+    HR_TraceHeader header;
+    const char* records;
+    void* mapping;
+    size_t mapping_size;
+    char* buffer;                           // records parsed from a text trace
+};
+
+// Cursors are independent, so several threads can replay the same trace at once
+struct HR_TraceCursor {
+    const HR_Trace* trace;
+    int64_t position;
+    double timestamp;
+};
+
+HR_Trace* open_trace(const std::string& file_path);
+bool write_trace(const HR_Trace* trace, const std::string& file_path, bool delta);
+HR_TraceCursor trace_cursor(const HR_Trace* trace);
+
+inline bool next_trace_request(HR_TraceCursor* cursor, HR_TraceRequest* request) {
+    const HR_Trace* trace = cursor->trace;
+    if (cursor->position >= trace->header.requests_count) {
+        return false;
+    }
+
+    if (trace->header.flags & HR_TRACE_DELTA) {
+        const HR_TraceDeltaRecord* record = reinterpret_cast<const HR_TraceDeltaRecord*>(trace->records) + cursor->position;
+        cursor->timestamp += record->timestamp_delta;
+        request->timestamp = cursor->timestamp;
+        request->object_id = record->object_id;
+        request->size = record->size;
+    } else {
+        const HR_TraceRecord* record = reinterpret_cast<const HR_TraceRecord*>(trace->records) + cursor->position;
+        request->timestamp = record->timestamp;
+        request->object_id = record->object_id;
+        request->size = record->size;
+    }
+    cursor->position++;
+    return true;
+}
+
+void close_trace(HR_Trace* trace);
+
+#endif // HR_TRACE_H
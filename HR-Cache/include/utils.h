@@ -1,9 +1,79 @@
 #ifndef HR_UTILS_H
 #define HR_UTILS_H
 
+#include <algorithm>
+
 void report_memory();
 void calculate_diffs(const double *input, const int input_count, double *intervals, int *diff_count);
 void nelson_aalen_fitter(double* durations, double* cumulative_hazards, int* data_count, bool discrete);
+
+// Nelson-Aalen fits of many objects sharing one segmented buffer, without allocating per object.
+// Segment i starts at offsets[i] of durations and cumulative_hazards, slot 0 being left for the
+// 0 the fit prepends, and holds counts[i] intervals from slot 1 on, the last of them censored.
+// Each segment is fitted in place: counts[i] becomes the number of fitted durations and
+// bandwidths[i] their Scott's rule bandwidth.
+void nelson_aalen_fit_segments(
+    double* durations,
+    double* cumulative_hazards,
+    const long long* offsets,
+    int* counts,
+    double* bandwidths,
+    int segments_count,
+    bool discrete
+);
 double calculate_hazard(double input, double* timestamps_diffs, double* cumulative_hazards_diffs, int diffs_count, double bandwidth);
 
+// Hazard evaluations for many (object, elapsed time) pairs, one column per argument.
+// calculate_hazards fills hazards with a SIMD kernel picked for the CPU at startup.
+struct HR_HazardBatch {
+    int count;
+    int capacity;
+    double* inputs;
+    const double** timestamps_diffs;
+    const double** cumulative_hazards_diffs;
+    int* diffs_counts;
+    double* bandwidths;
+    double* hazards;
+};
+
+// A smoothed hazard function sampled on a uniform grid of ages and linearly interpolated in between.
+// The hazard is 0 outside of the grid, which spans the kernel support. With a grid step of
+// max_error * bandwidth the interpolation error stays below max_error * 3/4 * sum(hazards) / bandwidth,
+// max_error times the largest value the hazard can reach. A curve that needs more than max_points
+// for that step, or a max_error that is not positive, is not built, and its hazards are computed exactly.
+struct HR_HazardCurve {
+    double start;                           // age of the first grid point
+    double scale;                           // grid points per unit of age
+    int count;                              // 0 when the curve could not be built
+    double* values;
+};
+
+int hazard_curve_points(const double* timestamps_diffs, int diffs_count, double bandwidth, double max_error, int max_points);
+void build_hazard_curve(
+    HR_HazardCurve* curve,
+    HR_HazardBatch* batch,
+    const double* timestamps_diffs,
+    const double* cumulative_hazards_diffs,
+    int diffs_count,
+    double bandwidth,
+    int points
+);
+
+inline double hazard_curve_value(const HR_HazardCurve* curve, double age) {
+    double position = (age - curve->start) * curve->scale;
+    if (!(position >= 0) || position > curve->count - 1) {
+        return 0;
+    }
+    int i = std::min(static_cast<int>(position), curve->count - 2);
+    double fraction = position - i;
+    return curve->values[i] + (curve->values[i + 1] - curve->values[i]) * fraction;
+}
+
+HR_HazardBatch* create_hazard_batch(int capacity);
+void reserve_hazard_batch(HR_HazardBatch* batch, int capacity);
+int add_hazard_query(HR_HazardBatch* batch, double input, const double* timestamps_diffs, const double* cumulative_hazards_diffs, int diffs_count, double bandwidth);
+void calculate_hazards(HR_HazardBatch* batch);
+const char* hazard_kernel_name();
+void destroy_hazard_batch(HR_HazardBatch* batch);
+
 #endif // HR_UTILS_H
\ No newline at end of file